@@ -82,10 +82,20 @@ consoleread(int user_dst, uint64 dst, int n)
   uint target;
   int c;
   char cbuf;
+  uint64 pf = 0;  // where the faulted-in part of dst ends
 
   target = n;
   acquire(&cons.lock);
   while(n > 0){
+    if(user_dst && dst >= pf){
+      // fault in the next page of dst, which can't be done
+      // under the lock; see uvmprefault().
+      release(&cons.lock);
+      uvmprefault(myproc()->pagetable, dst, 1);
+      pf = PGROUNDDOWN(dst) + PGSIZE;
+      acquire(&cons.lock);
+    }
+
     // wait until interrupt handler has put some
     // input into cons.buffer.
     while(cons.r == cons.w){
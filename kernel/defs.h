@@ -2,12 +2,17 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
+struct memstat;
+struct procmem;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
+struct spawnact;
 struct stat;
 struct superblock;
+struct vma;
 struct Queue;
 
 // bio.c
@@ -25,6 +30,11 @@ void            consputc(int);
 
 // exec.c
 int             exec(char*, char**);
+int             procexec(struct proc*, char*, char**);
+
+// fdt.c
+extern uint64   dtb;
+int             bootparam(char*, int);
 
 // file.c
 struct file*    filealloc(void);
@@ -64,6 +74,21 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kdup(void *);
+int             krefcount(void *);
+void*           kalloc_pages(int);
+void            kfree_pages(void *, int);
+void            ksplit_pages(void *, int);
+void            kmemstat(struct memstat*);
+void*           kzalloc(void);
+void            kzfree(void *);
+void            kzrefill(void);
+
+// slab.c
+void            kmem_cache_init(struct kmem_cache*, char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
+int             kmem_cache_reclaim(void);
 
 // log.c
 void            initlog(int, struct superblock*);
@@ -71,7 +96,30 @@ void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmap(uint64, int, int, int, struct file*, int);
+int             munmap(uint64, int);
+uint64          vmabase(struct proc*);
+int             vmacopy(struct proc*, struct proc*);
+void            vmaunmapall(pagetable_t, struct vma*);
+
+// swap.c
+void            swapinit(void);
+int             swapout(void);
+uint64          swapin(pagetable_t, uint64);
+void            swapfree(uint);
+int             swapcount(void);
+
+// pgcache.c
+void            pgcacheinit(void);
+uint64          pgcache_get(struct inode*, uint, int);
+void            pgcache_write(struct inode*, uint, char*, uint);
+void            pgcache_invalidate(struct inode*);
+int             pgcache_reclaim(void);
+int             pgcache_count(void);
+
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, uint64, int);
@@ -87,14 +135,18 @@ int             cpuid(void);
 void            exit(int);
 int             fork(void);
 int             growproc(int);
-void            proc_mapstacks(pagetable_t);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
+pagetable_t     proc_execpagetable(struct proc *);
+int             procmem(uint64, int);
+int             spawn(char*, char**, struct spawnact*, int);
+void            proc_freeexecpagetable(pagetable_t, uint64);
 int             kill(int);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
 void            procinit(void);
+struct proc*    procfrom(int);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
@@ -103,6 +155,8 @@ int             wait(uint64);
 int             waitx(uint64, uint*, uint*);
 void            wakeup(void*);
 void            yield(void);
+void            preempt_point(void);
+void            kpreempt(void);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -112,7 +166,17 @@ void            InitQueue();
 void            push(struct Queue *q, struct proc* el);
 void            pop(struct Queue *q);
 struct proc*    front(struct Queue *q);
-void            eraseq(struct Queue *q, int pid);
+void            eraseq(struct Queue *q, struct proc *p);
+
+// schedtrace.c
+#ifdef SCHEDTRACE
+void            schedtraceinit(void);
+void            schedtrace_log(int, struct proc*, int);
+int             schedtrace_read(uint64, int);
+#else
+#define schedtraceinit()
+#define schedtrace_log(type, p, arg)
+#endif
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -166,15 +230,34 @@ int             uartgetc(void);
 void            kvminit(void);
 void            kvminithart(void);
 void            kvmmap(pagetable_t, uint64, uint64, uint64, int);
+int             kvmmapstack(uint64);
+void            kvmunmapstack(uint64);
 int             mappages(pagetable_t, uint64, uint64, uint64, int);
+pte_t*          walk(pagetable_t, uint64, int);
 pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64, int);
+int             uvmcow(pagetable_t, uint64);
+int             uvmsplit(pagetable_t, uint64);
+uint64          vmfault(pagetable_t, uint64);
+void            uvmprefault(pagetable_t, uint64, uint64);
+void            uvmpin(struct proc*, uint64, uint64);
+void            asidinit(void);
+uint64          uvmsatp(struct proc*);
+void            tlbflush(struct proc*, uint64);
+int             ufault(uint64, uint64, uint64*);
+#ifdef SHAREDPT
+void            kvmshare(pagetable_t);
+void            kvmunshare(pagetable_t);
+void            uvmswitch(struct proc*);
+#endif
+void            vmaclear(struct vma*);
 void            uvmfree(pagetable_t, uint64);
+void            uvmadopt(pagetable_t, pagetable_t);
+void            uvmstat(pagetable_t, struct procmem*);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
-void            uvmclear(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -6,20 +6,27 @@
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fcntl.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
-
+// Replace p's user memory with the program at path, run with
+// arguments argv. p is the current process, or a new one from
+// spawn() that isn't running yet. Returns argc, or -1.
 int
-exec(char *path, char **argv)
+procexec(struct proc *p, char *path, char **argv)
 {
-  char *s, *last;
+  char *s, *last, *mem;
   int i, off;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
-  pagetable_t pagetable = 0, oldpagetable;
-  struct proc *p = myproc();
+  pagetable_t pagetable = 0;
+  struct vma vmas[NVMA], *v;
+#ifdef EXECNEWPT
+  pagetable_t oldpagetable;
+#endif
+
+  memset(vmas, 0, sizeof(vmas));
 
   begin_op();
 
@@ -35,10 +42,17 @@ exec(char *path, char **argv)
   if(elf.magic != ELF_MAGIC)
     goto bad;
 
+#ifdef EXECNEWPT
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
+#else
+  if((pagetable = proc_execpagetable(p)) == 0)
+    goto bad;
+#endif
 
-  // Load program into memory.
+  // Map the program's segments. Nothing is read yet:
+  // vmfault() reads each page from ip on first touch.
+  v = vmas;
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
@@ -48,31 +62,57 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr + ph.memsz < ph.vaddr)
       goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if(ph.vaddr + ph.memsz >= USERTOP)
       goto bad;
-    sz = sz1;
     if((ph.vaddr % PGSIZE) != 0)
       goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(v == &vmas[NVMA])
       goto bad;
+    v->start = ph.vaddr;
+    v->end = ph.vaddr + ph.memsz;
+    v->off = ph.off;
+    v->filesz = ph.filesz;
+    v->perm = PTE_U;
+    if(ph.flags & ELF_PROG_FLAG_READ)
+      v->perm |= PTE_R;
+    if(ph.flags & ELF_PROG_FLAG_WRITE)
+      v->perm |= PTE_W;
+    if(ph.flags & ELF_PROG_FLAG_EXEC)
+      v->perm |= PTE_X;
+    v->ip = idup(ip);
+    v->flags = MAP_PRIVATE;
+    v++;
+    if(ph.vaddr + ph.memsz > sz)
+      sz = ph.vaddr + ph.memsz;
   }
   iunlockput(ip);
   end_op();
   ip = 0;
 
-  p = myproc();
   uint64 oldsz = p->sz;
 
-  // Allocate two pages at the next page boundary.
-  // Use the second as the user stack.
+  // The user stack is a VMA of NSTACK pages below USTACK,
+  // which vmfault() fills in as the stack grows down. Its
+  // top page, for the arguments, is allocated now. The page
+  // below USTACKBASE is never mapped, so an overflow faults.
+  // Every page mapped below sz or in a VMA has PTE_U, and
+  // nothing else is mapped there: SHAREDPT's direct copies
+  // (see udirect()) rely on it, since with SUM set the kernel
+  // could reach a page without PTE_U without faulting.
   sz = PGROUNDUP(sz);
-  uint64 sz1;
-  if((sz1 = uvmalloc(pagetable, sz, sz + 2*PGSIZE)) == 0)
+  if(v == &vmas[NVMA])
+    goto bad;
+  v->start = USTACKBASE;
+  v->end = USTACK;
+  v->perm = PTE_R|PTE_W|PTE_U;
+  v->flags = MAP_PRIVATE;
+  if((mem = kzalloc()) == 0)
     goto bad;
-  sz = sz1;
-  uvmclear(pagetable, sz-2*PGSIZE);
-  sp = sz;
+  if(mappages(pagetable, USTACK - PGSIZE, PGSIZE, (uint64)mem, v->perm | PTE_A) != 0){
+    kfree(mem);
+    goto bad;
+  }
+  sp = USTACK;
   stackbase = sp - PGSIZE;
 
   // Push argument strings, prepare rest of stack in ustack.
@@ -109,46 +149,62 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
-  oldpagetable = p->pagetable;
-  p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  for(i = 0; i < NVMA; i++){
+    struct vma old = p->vmas[i];
+    p->vmas[i] = vmas[i];
+    vmas[i] = old;
+  }
+#ifdef EXECNEWPT
+  // switch to the new page table, then drop the old one with
+  // the old image's segments, mmap()s and memory.
+  oldpagetable = p->pagetable;
+  p->pagetable = pagetable;
+  p->asidgen = 0;
+#ifdef SHAREDPT
+  if(p == myproc())
+    uvmswitch(p);
+#endif
+  vmaunmapall(oldpagetable, vmas);
   proc_freepagetable(oldpagetable, oldsz);
+#else
+  // drop the old image's segments, mmap()s and memory, and
+  // move the new one into p's page table, which stays.
+  vmaunmapall(p->pagetable, vmas);
+  uvmunmap(p->pagetable, 0, PGROUNDUP(oldsz)/PGSIZE, 1);
+  uvmadopt(p->pagetable, pagetable);
+  // the old ASID's TLB entries are for the old image.
+  p->asidgen = 0;
+#ifdef SHAREDPT
+  if(p == myproc())
+    uvmswitch(p);
+#endif
+#endif
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
 
  bad:
-  if(pagetable)
+  if(pagetable){
+    uvmunmap(pagetable, USTACKBASE, NSTACK, 1);
+#ifdef EXECNEWPT
     proc_freepagetable(pagetable, sz);
-  if(ip){
-    iunlockput(ip);
-    end_op();
+#else
+    proc_freeexecpagetable(pagetable, sz);
+#endif
   }
+  if(ip == 0)
+    begin_op();
+  vmaclear(vmas);
+  if(ip)
+    iunlockput(ip);
+  end_op();
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
-static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+int
+exec(char *path, char **argv)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
-  return 0;
+  return procexec(myproc(), path, argv);
 }
@@ -3,3 +3,24 @@
 #define O_RDWR    0x002
 #define O_CREATE  0x200
 #define O_TRUNC   0x400
+
+// mmap() protection and flags
+#define PROT_READ     0x1
+#define PROT_WRITE    0x2
+#define PROT_EXEC     0x4
+
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_ANONYMOUS 0x20
+#define MAP_FAILED    ((void*)-1)
+
+// spawn() file actions, applied in order to the child's copy
+// of the parent's open files.
+#define SPAWN_DUP     1  // fd becomes a copy of the parent's src
+#define SPAWN_CLOSE   2  // fd is closed
+
+struct spawnact {
+  int op;
+  int fd;
+  int src;
+};
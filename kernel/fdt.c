@@ -0,0 +1,114 @@
+// Boot parameters, from the flattened devicetree that qemu
+// passes in register a1 when it starts the kernel. qemu puts
+// the string given with -append in the /chosen node's bootargs
+// property, as space-separated name=value words.
+//
+// qemu places the devicetree in RAM above the kernel, so it
+// must be read before kinit() hands those pages out.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define FDT_MAGIC       0xd00dfeed
+#define FDT_BEGIN_NODE  1
+#define FDT_END_NODE    2
+#define FDT_PROP        3
+#define FDT_NOP         4
+#define FDT_END         9
+
+uint64 dtb;  // physical address of the devicetree, set by start()
+
+// the devicetree is big-endian.
+static uint32
+be32(char *p)
+{
+  uchar *u = (uchar*)p;
+
+  return ((uint32)u[0] << 24) | (u[1] << 16) | (u[2] << 8) | u[3];
+}
+
+// Return /chosen's bootargs, setting *len to its length
+// including the terminating 0, or 0 if there is none.
+static char*
+bootargs(int *len)
+{
+  char *fdt, *p, *strs, *name;
+  uint32 tok, size, n;
+  int depth, chosen;
+
+  if(dtb < KERNBASE || dtb >= PHYSTOP)
+    return 0;
+  fdt = (char*)dtb;
+  if(be32(fdt) != FDT_MAGIC)
+    return 0;
+  size = be32(fdt + 4);
+  p = fdt + be32(fdt + 8);
+  strs = fdt + be32(fdt + 12);
+  depth = 0;
+  chosen = 0;
+  while(p < fdt + size){
+    tok = be32(p);
+    p += 4;
+    switch(tok){
+    case FDT_BEGIN_NODE:
+      name = p;
+      depth++;
+      if(depth == 2 && strncmp(name, "chosen", 7) == 0)
+        chosen = 1;
+      p += (strlen(name) + 4) & ~3;
+      break;
+    case FDT_END_NODE:
+      if(depth == 2)
+        chosen = 0;
+      depth--;
+      break;
+    case FDT_PROP:
+      n = be32(p);
+      name = strs + be32(p + 4);
+      p += 8;
+      if(chosen && n > 0 && strncmp(name, "bootargs", 9) == 0){
+        *len = n;
+        return p;
+      }
+      p += (n + 3) & ~3;
+      break;
+    case FDT_NOP:
+      break;
+    default:  // FDT_END or garbage
+      return 0;
+    }
+  }
+  return 0;
+}
+
+// Return the value of boot parameter name (name=value
+// in qemu's -append string), or def if it isn't given.
+int
+bootparam(char *name, int def)
+{
+  char *s, *e;
+  int len, n, v;
+
+  if((s = bootargs(&len)) == 0)
+    return def;
+  e = s + len - 1;
+  n = strlen(name);
+  while(s < e){
+    while(s < e && *s == ' ')
+      s++;
+    if(e - s > n && strncmp(s, name, n) == 0 && s[n] == '='){
+      s += n + 1;
+      if(s >= e || *s < '0' || *s > '9')
+        return def;
+      for(v = 0; s < e && *s >= '0' && *s <= '9'; s++)
+        v = v*10 + *s - '0';
+      return v;
+    }
+    while(s < e && *s != ' ')
+      s++;
+  }
+  return def;
+}
@@ -12,35 +12,36 @@
 #include "file.h"
 #include "stat.h"
 #include "proc.h"
+#include "slab.h"
 
 struct devsw devsw[NDEV];
+
+// Open files come from a slab cache; the lock
+// guards their reference counts.
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache cache;
 } ftable;
 
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  kmem_cache_init(&ftable.cache, "file", sizeof(struct file));
 }
 
 // Allocate a file structure.
+// Returns 0 if out of memory.
 struct file*
 filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(&ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -69,9 +70,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(&ftable.cache, f);
 
   if(ff.type == FD_PIPE){
     pipeclose(ff.pipe, ff.writable);
@@ -106,11 +106,16 @@ filestat(struct file *f, uint64 addr)
 int
 fileread(struct file *f, uint64 addr, int n)
 {
-  int r = 0;
+  int r = 0, m, i;
 
-  if(f->readable == 0)
+  if(f->readable == 0 || n < 0)
     return -1;
+  if(n == 0)
+    return 0;
 
+  // pipes and the console copy out under a spinlock, and
+  // files under the inode's lock, so each faults in the part
+  // of the buffer it is about to fill first; see uvmprefault().
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -118,10 +123,28 @@ fileread(struct file *f, uint64 addr, int n)
       return -1;
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
-    ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
-      f->off += r;
-    iunlock(f->ip);
+    // a page of the buffer at a time, so that a read that
+    // stops at the end of the file faults in no more of a big
+    // buffer than it fills.
+    for(i = 0; i < n; i += m){
+      m = PGSIZE - (addr + i) % PGSIZE;
+      if(m > n - i)
+        m = n - i;
+      uvmprefault(myproc()->pagetable, addr + i, m);
+      ilock(f->ip);
+      r = readi(f->ip, 1, addr + i, f->off, m);
+      if(r > 0)
+        f->off += r;
+      iunlock(f->ip);
+      if(r != m){
+        if(r < 0 && i == 0)
+          return -1;
+        if(r > 0)
+          i += r;
+        break;
+      }
+    }
+    r = i;
   } else {
     panic("fileread");
   }
@@ -136,8 +159,10 @@ filewrite(struct file *f, uint64 addr, int n)
 {
   int r, ret = 0;
 
-  if(f->writable == 0)
+  if(f->writable == 0 || n < 0)
     return -1;
+  if(n == 0)
+    return 0;
 
   if(f->type == FD_PIPE){
     ret = pipewrite(f->pipe, addr, n);
@@ -159,6 +184,8 @@ filewrite(struct file *f, uint64 addr, int n)
       if(n1 > max)
         n1 = max;
 
+      // before locking the inode; see uvmprefault().
+      uvmprefault(myproc()->pagetable, addr + i, n1);
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
@@ -18,8 +18,11 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next; // on itable's inuse or unused list
+  struct inode *prev;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
+  int pgcached;       // pgcache.c may hold pages of this file
 
   short type;         // copy of disk inode
   short major;
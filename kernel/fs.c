@@ -20,6 +20,7 @@
 #include "fs.h"
 #include "buf.h"
 #include "file.h"
+#include "slab.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 // there should be one superblock per disk device, but we run with
@@ -113,11 +114,14 @@ bfree(int dev, uint b)
 // sb.startinode. Each inode has a number, indicating its
 // position on the disk.
 //
-// The kernel keeps a table of in-use inodes in memory
+// The kernel keeps the in-use inodes in memory
 // to provide a place for synchronizing access
 // to inodes used by multiple processes. The in-memory
 // inodes include book-keeping information that is
 // not stored on disk: ip->ref and ip->valid.
+// In-memory inodes come from a slab cache, and up to
+// NINODE unused ones are kept, most recently used first,
+// so that reopening a file finds it still read in.
 //
 // An inode and its in-memory representation go through a
 // sequence of states before they can be used by the
@@ -127,12 +131,13 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
+// * Referencing in table: an in-memory inode is unused
+//   if ip->ref is zero. Otherwise ip->ref tracks
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+//   creates an in-memory inode and increments its ref; iput()
+//   decrements ref, and frees the least recently used
+//   unused inode once there are more than NINODE.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
@@ -162,10 +167,10 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The itable.lock spin-lock protects the itable lists. Since
+// ip->ref indicates which list an inode is on, and ip->dev and
+// ip->inum indicate which i-node it holds, one must hold
+// itable.lock while using any of those fields.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
@@ -173,18 +178,71 @@ bfree(int dev, uint b)
 
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache cache;
+  struct inode *inuse;    // inodes with ref > 0
+  struct inode *unused;   // ref == 0, most recently used first
+  struct inode *lru;      // last on unused
+  int nunused;
 } itable;
 
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  kmem_cache_init(&itable.cache, "inode", sizeof(struct inode));
+}
+
+// Unlink ip from the list it is on. Caller holds itable.lock.
+static void
+iunlink(struct inode *ip)
+{
+  if(ip->prev)
+    ip->prev->next = ip->next;
+  else if(ip->ref > 0)
+    itable.inuse = ip->next;
+  else
+    itable.unused = ip->next;
+  if(ip->next)
+    ip->next->prev = ip->prev;
+  else if(ip->ref == 0)
+    itable.lru = ip->prev;
+  if(ip->ref == 0)
+    itable.nunused--;
+}
+
+// Put ip at the front of the list its ref says.
+// Caller holds itable.lock.
+static void
+ipush(struct inode *ip)
+{
+  struct inode **head;
+
+  head = ip->ref > 0 ? &itable.inuse : &itable.unused;
+  ip->prev = 0;
+  ip->next = *head;
+  if(*head)
+    (*head)->prev = ip;
+  else if(ip->ref == 0)
+    itable.lru = ip;
+  *head = ip;
+  if(ip->ref == 0)
+    itable.nunused++;
+}
+
+// Take the least recently used unused inode off its list,
+// dropping pages cached for its file. Returns 0 if there
+// is none. Caller holds itable.lock.
+static struct inode*
+ievict(void)
+{
+  struct inode *ip;
+
+  if((ip = itable.lru) == 0)
+    return 0;
+  iunlink(ip);
+  if(ip->pgcached)
+    pgcache_invalidate(ip);
+  return ip;
 }
 
 static struct inode* iget(uint dev, uint inum);
@@ -236,39 +294,69 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
-// Find the inode with number inum on device dev
-// and return the in-memory copy. Does not lock
-// the inode and does not read it from disk.
+// Find inode inum on device dev in memory, and take a
+// reference to it. Returns 0 if it isn't there.
+// Caller holds itable.lock.
 static struct inode*
-iget(uint dev, uint inum)
+ifind(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
+  struct inode *ip;
 
-  // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
+  for(ip = itable.inuse; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
       ip->ref++;
-      release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
+  // an unused one keeps what was read from disk, since
+  // every change to it went through iupdate().
+  for(ip = itable.unused; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      iunlink(ip);
+      ip->ref = 1;
+      ipush(ip);
+      return ip;
+    }
+  }
+  return 0;
+}
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
+// Find the inode with number inum on device dev
+// and return the in-memory copy. Does not lock
+// the inode and does not read it from disk.
+static struct inode*
+iget(uint dev, uint inum)
+{
+  struct inode *ip, *new;
 
-  ip = empty;
-  ip->dev = dev;
-  ip->inum = inum;
-  ip->ref = 1;
-  ip->valid = 0;
+  acquire(&itable.lock);
+  ip = ifind(dev, inum);
+  release(&itable.lock);
+  if(ip)
+    return ip;
+
+  // kmem_cache_alloc() may call kalloc(), which may reclaim,
+  // so not under itable.lock. Someone else may read in the
+  // same inode meanwhile, so look again.
+  if((new = kmem_cache_alloc(&itable.cache)) != 0)
+    initsleeplock(&new->lock, "inode");
+  acquire(&itable.lock);
+  if((ip = ifind(dev, inum)) == 0){
+    // out of memory: recycle an unused inode.
+    if((ip = new) == 0 && (ip = ievict()) == 0)
+      panic("iget: no inodes");
+    new = 0;
+    ip->dev = dev;
+    ip->inum = inum;
+    ip->ref = 1;
+    ip->valid = 0;
+    ip->pgcached = 0;
+    ipush(ip);
+  }
   release(&itable.lock);
 
+  if(new)
+    kmem_cache_free(&itable.cache, new);
   return ip;
 }
 
@@ -323,8 +411,9 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode table entry can
-// be recycled.
+// If that was the last reference, the inode joins the
+// unused ones, and the least recently used of those is
+// freed if there are too many.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -353,6 +442,19 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
+  if(ip->ref == 1){
+    iunlink(ip);
+    ip->ref = 0;
+    ipush(ip);
+    if(itable.nunused > NINODE)
+      ip = ievict();
+    else
+      ip = 0;
+    release(&itable.lock);
+    if(ip)
+      kmem_cache_free(&itable.cache, ip);
+    return;
+  }
   ip->ref--;
   release(&itable.lock);
 }
@@ -413,6 +515,9 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  if(ip->pgcached)
+    pgcache_invalidate(ip);
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -426,6 +531,7 @@ itrunc(struct inode *ip)
     for(j = 0; j < NINDIRECT; j++){
       if(a[j])
         bfree(ip->dev, a[j]);
+      preempt_point();
     }
     brelse(bp);
     bfree(ip->dev, ip->addrs[NDIRECT]);
@@ -501,8 +607,11 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       brelse(bp);
       break;
     }
+    if(ip->pgcached)
+      pgcache_write(ip, off, (char*)bp->data + (off % BSIZE), m);
     log_write(bp);
     brelse(bp);
+    preempt_point();
   }
 
   if(off > ip->size)
@@ -1,6 +1,47 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages, and
+// blocks of 2^order contiguous pages.
+//
+// Free memory lives in a binary buddy allocator: a free list
+// per order, where a block of 2^order pages is aligned to its
+// size. kalloc_pages() splits a bigger block when it has to,
+// and kfree_pages() joins a freed block with its buddy, the
+// other half of the block one order up, whenever that is free
+// as well.
+//
+// Each CPU also keeps its own list of free pages, so kalloc()
+// and kfree() normally touch only this CPU's list and lock. A
+// CPU whose list runs dry takes KBATCH pages from the buddy
+// allocator, and one holding more than 2*KBATCH gives KBATCH
+// back. If the buddy allocator is empty too, it steals half of
+// another CPU's list.
+//
+// To try out NUMA placement policies, the buddy allocator is
+// split into nnode zones, contiguous ranges of memory that
+// stand in for the memory of that many nodes, each with its
+// own free lists and lock. nnode is the nodes=n boot parameter
+// (make NODES=n passes it to qemu), up to MAXNODE, and 1 if it
+// isn't given. CPU i belongs to node i % nnode. Pages are
+// allocated from the allocating CPU's node's zone first, then
+// the others in turn; since user pages are allocated when
+// first touched, they come from the zone of the CPU that
+// touched them. kfree() sends a page from another node's zone
+// straight back to its zone rather than keeping it on this
+// CPU's list. Each CPU counts the pages it hands out from its
+// own node's zone (hits) and from others (misses); see
+// kmemstat().
+//
+// Pages shared copy-on-write after fork() carry a reference
+// count; kfree() only frees a page when its count drops to 0.
+//
+// kfree() and kalloc() fill pages with junk to catch dangling
+// references, unless built with NOJUNK=1. Callers that want a
+// zeroed page use kzalloc(), which takes one from a pool that
+// CPUs with nothing to run keep filled (kzrefill()). Pages that
+// are freed zeroed, such as page-table pages freewalk() has
+// cleared, go to kzfree(), which keeps a few on a per-CPU list
+// ahead of the pool.
 
 #include "types.h"
 #include "param.h"
@@ -8,58 +49,430 @@
 #include "spinlock.h"
 #include "riscv.h"
 #include "defs.h"
+#include "memstat.h"
 
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define NPAGES ((PHYSTOP - KERNBASE) / PGSIZE)
+
 struct run {
   struct run *next;
+  struct run *prev;  // buddy lists only
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+};
+
+struct kmem kcpu[NCPU];  // per-CPU free lists
+struct kmem zpool;       // zeroed pages for kzalloc()
+struct kmem zcpu[NCPU];  // per-CPU zeroed pages from kzfree()
+
+struct zone {
+  struct spinlock lock;
+  uint64 start, end;          // the page indices it covers
+  struct run *free[MAXORDER+1];
+  int nfree[MAXORDER+1];      // blocks on each list
+};
+
+struct zone zones[MAXNODE];
+static int nnode;  // zones in use, set at boot by zoneinit()
+
+#define CPUNODE(id) ((id) % nnode)
+
+// order of the free block starting at each page, or -1 if
+// no free block starts there. Under the page's zone's lock.
+static signed char blockorder[NPAGES];
+
+// pages handed out on each CPU from its own node's zone,
+// and from other zones.
+static uint64 hits[NCPU], misses[NCPU];
+
+// Reference counts, by physical page number. Updated with
+// atomic adds, so they need no lock. A block from
+// kalloc_pages() uses its first page's count.
+static int refcnt[NPAGES];
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+#define REF2PA(i) ((void*)(KERNBASE + (uint64)(i) * PGSIZE))
+
+// Split the pages from the kernel's end to PHYSTOP into
+// nnode zones of about the same size. The boundaries fall on
+// 2^MAXORDER pages, so that no block, or its buddy, spans two.
+static void
+zoneinit(void)
+{
+  uint64 first, per, b;
+  int n;
+
+  nnode = bootparam("nodes", 1);
+  if(nnode < 1 || nnode > MAXNODE){
+    printf("kinit: nodes=%d out of range, using 1\n", nnode);
+    nnode = 1;
+  }
+  first = PA2REF(PGROUNDUP((uint64)end));
+  per = (NPAGES - first) / nnode;
+  for(n = 0; n < nnode; n++){
+    initlock(&zones[n].lock, "zone");
+    zones[n].start = n == 0 ? first : zones[n-1].end;
+    b = (first + (n+1) * per + (1 << MAXORDER) - 1) & ~((1UL << MAXORDER) - 1);
+    zones[n].end = n == nnode-1 || b > NPAGES ? NPAGES : b;
+    if(zones[n].end < zones[n].start)
+      zones[n].end = zones[n].start;
+  }
+}
+
+// The zone that page index i is in.
+static struct zone*
+pagezone(uint64 i)
+{
+  struct zone *z;
+
+  for(z = zones; z < &zones[nnode-1] && i >= z->end; z++)
+    ;
+  return z;
+}
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  zoneinit();
+  memset(blockorder, -1, sizeof(blockorder));
+  for(int i = 0; i < NCPU; i++){
+    initlock(&kcpu[i].lock, "kmem cpu");
+    initlock(&zcpu[i].lock, "zero cpu");
+  }
+  initlock(&zpool.lock, "zpool");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Free [pa_start, pa_end) in the biggest blocks
+// that alignment allows.
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
+  int order;
+
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  while(p + PGSIZE <= (char*)pa_end){
+    for(order = MAXORDER; order > 0; order--)
+      if(PA2REF(p) % (1 << order) == 0 && p + (PGSIZE << order) <= (char*)pa_end)
+        break;
+    refcnt[PA2REF(p)] = 1;
+    kfree_pages(p, order);
+    p += PGSIZE << order;
+  }
+}
+
+// Unlink the free block at page index i from z's list.
+// Caller holds z->lock.
+static void
+unlinkblock(struct zone *z, uint64 i, int order)
+{
+  struct run *r = REF2PA(i);
+
+  if(r->prev)
+    r->prev->next = r->next;
+  else
+    z->free[order] = r->next;
+  if(r->next)
+    r->next->prev = r->prev;
+  z->nfree[order]--;
+  blockorder[i] = -1;
+}
+
+// Put the free block at page index i on z's list.
+// Caller holds z->lock.
+static void
+pushblock(struct zone *z, uint64 i, int order)
+{
+  struct run *r = REF2PA(i);
+
+  r->prev = 0;
+  r->next = z->free[order];
+  if(r->next)
+    r->next->prev = r;
+  z->free[order] = r;
+  z->nfree[order]++;
+  blockorder[i] = order;
+}
+
+// Take a block of 2^order pages from z, splitting a bigger
+// one if need be. Returns its page index, or -1 if there is
+// none. Caller holds z->lock.
+static int
+buddyalloc(struct zone *z, int order)
+{
+  uint64 i;
+  int o;
+
+  for(o = order; o <= MAXORDER && z->free[o] == 0; o++)
+    ;
+  if(o > MAXORDER)
+    return -1;
+  i = PA2REF(z->free[o]);
+  unlinkblock(z, i, o);
+  // give back the upper halves.
+  while(o > order){
+    o--;
+    pushblock(z, i + (1 << o), o);
+  }
+  return i;
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
-// call to kalloc().  (The exception is when
-// initializing the allocator; see kinit above.)
+// Free the block of 2^order pages at page index i to its
+// zone z, joining it with its buddy as long as the buddy is
+// free and whole. Pages below the kernel's end are never
+// free, so joining stops there. Caller holds z->lock.
+static void
+buddyfree(struct zone *z, uint64 i, int order)
+{
+  uint64 b;
+
+  while(order < MAXORDER){
+    b = i ^ (1 << order);
+    if(b < z->start || b >= z->end || blockorder[b] != order)
+      break;
+    unlinkblock(z, b, order);
+    if(b < i)
+      i = b;
+    order++;
+  }
+  pushblock(z, i, order);
+}
+
+// Take a block of 2^order pages from node's zone, or else
+// from the other zones in turn. Returns its page index, or
+// -1 if there is none.
+static int
+zonealloc(int node, int order)
+{
+  struct zone *z;
+  int i, n;
+
+  for(n = 0; n < nnode; n++){
+    z = &zones[(node + n) % nnode];
+    acquire(&z->lock);
+    i = buddyalloc(z, order);
+    release(&z->lock);
+    if(i >= 0)
+      return i;
+  }
+  return -1;
+}
+
+// Count a page handed out on this CPU as a hit or a miss.
+static void
+account(void *pa)
+{
+  int id;
+
+  push_off();
+  id = cpuid();
+  if(pagezone(PA2REF(pa)) == &zones[CPUNODE(id)])
+    hits[id]++;
+  else
+    misses[id]++;
+  pop_off();
+}
+
+// Unlink up to n pages from the front of k's list.
+// Returns the first, and sets *tail to the last
+// and *np to how many; 0 if k is empty.
+static struct run*
+take(struct kmem *k, int n, struct run **tail, int *np)
+{
+  struct run *head, *r;
+  int i;
+
+  acquire(&k->lock);
+  head = k->freelist;
+  r = 0;
+  for(i = 0; i < n && k->freelist; i++){
+    r = k->freelist;
+    k->freelist = r->next;
+  }
+  k->nfree -= i;
+  release(&k->lock);
+
+  if(r)
+    r->next = 0;
+  *tail = r;
+  *np = i;
+  return i ? head : 0;
+}
+
+// Put the n pages from head to tail on the front of k's list.
+static void
+give(struct kmem *k, struct run *head, struct run *tail, int n)
+{
+  acquire(&k->lock);
+  tail->next = k->freelist;
+  k->freelist = head;
+  k->nfree += n;
+  release(&k->lock);
+}
+
+// Take up to n single pages from the buddy allocator, from
+// node's zone first. Returns a list as take() does.
+static struct run*
+takebuddy(int node, int n, struct run **tail, int *np)
+{
+  struct run *head, *r;
+  struct zone *z;
+  int i, j, k;
+
+  head = *tail = 0;
+  k = 0;
+  for(j = 0; j < nnode && k < n; j++){
+    z = &zones[(node + j) % nnode];
+    acquire(&z->lock);
+    for(; k < n && (i = buddyalloc(z, 0)) >= 0; k++){
+      r = REF2PA(i);
+      r->next = head;
+      head = r;
+      if(k == 0)
+        *tail = r;
+    }
+    release(&z->lock);
+  }
+  *np = k;
+  return head;
+}
+
+// Give the list from head back to the buddy allocator, each
+// page to its own zone.
+static void
+givebuddy(struct run *head)
+{
+  struct run *r;
+  struct zone *z, *held;
+
+  held = 0;
+  while((r = head) != 0){
+    head = r->next;
+    z = pagezone(PA2REF(r));
+    if(z != held){
+      if(held)
+        release(&held->lock);
+      acquire(&z->lock);
+      held = z;
+    }
+    buddyfree(z, PA2REF(r), 0);
+  }
+  if(held)
+    release(&held->lock);
+}
+
+// Give every CPU's free pages back to the buddy allocator,
+// so that they can join up into bigger blocks.
+static void
+drain(void)
+{
+  struct run *r, *tail;
+  int i, n;
+
+  for(i = 0; i < NCPU; i++)
+    if((r = take(&kcpu[i], kcpu[i].nfree, &tail, &n)) != 0)
+      givebuddy(r);
+}
+
+// Add a reference to a page returned by kalloc(),
+// for another page table that maps it.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(&refcnt[PA2REF(pa)], 1) < 1)
+    panic("kdup: free page");
+}
+
+// Return the number of references to the page at pa.
+int
+krefcount(void *pa)
+{
+  return refcnt[PA2REF(pa)];
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by v, which normally should have been returned by a
+// call to kalloc(), and free it if that was the last.
+// (The exception is when initializing the allocator;
+// see kinit above.)
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *tail;
+  struct kmem *c;
+  int id, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  if((n = __sync_sub_and_fetch(&refcnt[PA2REF(pa)], 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree: free page");
+
+#ifndef NOJUNK
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
+#endif
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  if(nnode > 1 && pagezone(PA2REF(r)) != &zones[CPUNODE(id)]){
+    // another node's page goes home.
+    r->next = 0;
+    givebuddy(r);
+    pop_off();
+    return;
+  }
+  c = &kcpu[id];
+  give(c, r, r, 1);
+  if(c->nfree > 2*KBATCH){
+    // hand a batch back to the buddy allocator.
+    if((r = take(c, KBATCH, &tail, &n)) != 0)
+      givebuddy(r);
+  }
+  pop_off();
+}
+
+// Free k's pages, which hold a reference each. Returns
+// how many.
+static int
+kzdrain(struct kmem *k)
+{
+  struct run *r, *next, *tail;
+  int n;
+
+  r = take(k, k->nfree, &tail, &n);
+  for(; r; r = next){
+    next = r->next;
+    kfree(r);
+  }
+  return n;
+}
+
+// Free the zeroed pages of the pool and the CPUs, for
+// kalloc() when memory runs out. Returns how many.
+static int
+kzreclaim(void)
+{
+  int i, n;
+
+  n = kzdrain(&zpool);
+  for(i = 0; i < NCPU; i++)
+    n += kzdrain(&zcpu[i]);
+  return n;
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -68,15 +481,206 @@ kfree(void *pa)
 void *
 kalloc(void)
 {
-  struct run *r;
+  struct run *r, *tail;
+  struct kmem *v;
+  int id, i, n;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  if((r = take(&kcpu[id], 1, &tail, &n)) == 0){
+    // refill from the buddy allocator, or else steal.
+    r = takebuddy(CPUNODE(id), KBATCH, &tail, &n);
+    for(i = 1; r == 0 && i < NCPU; i++){
+      v = &kcpu[(id + i) % NCPU];
+      r = take(v, (v->nfree + 1) / 2, &tail, &n);
+    }
+    if(n > 1)
+      give(&kcpu[id], r->next, tail, n - 1);
+  }
+  pop_off();
 
-  if(r)
+  // out of memory: give back pages that only the program
+  // page cache, the slab magazines or the zero pool hold,
+  // or else swap a user page out, and try again.
+  if(r == 0 && (pgcache_reclaim() + kmem_cache_reclaim() + kzreclaim() > 0 ||
+                swapout() > 0))
+    return kalloc();
+
+  if(r){
+    refcnt[PA2REF(r)] = 1;
+    account(r);
+#ifndef NOJUNK
     memset((char*)r, 5, PGSIZE); // fill with junk
+#endif
+  }
   return (void*)r;
 }
+
+// Allocate a zeroed page, from this CPU's list or the zero
+// pool if they have one. Returns 0 if out of memory.
+void *
+kzalloc(void)
+{
+  struct run *r, *tail;
+  int n;
+
+  // take() clears the link, so the whole page is zero.
+  push_off();
+  r = take(&zcpu[cpuid()], 1, &tail, &n);
+  pop_off();
+  if(r != 0 || (r = take(&zpool, 1, &tail, &n)) != 0){
+    account(r);
+    return (void*)r;
+  }
+  if((r = kalloc()) != 0)
+    memset(r, 0, PGSIZE);
+  return (void*)r;
+}
+
+// Free a page from kzalloc() that is all zero again, keeping
+// it for kzalloc(): on this CPU's list, or else in the zero
+// pool, unless both are full.
+void
+kzfree(void *pa)
+{
+  struct kmem *c;
+
+  if(krefcount(pa) != 1){
+    kfree(pa);
+    return;
+  }
+  push_off();
+  c = &zcpu[cpuid()];
+  if(c->nfree < NZCPU)
+    give(c, pa, pa, 1);
+  else if(zpool.nfree < NZPOOL)
+    give(&zpool, pa, pa, 1);
+  else
+    kfree(pa);
+  pop_off();
+}
+
+// Zero one free page into the zero pool, unless it is
+// full. Called by a CPU with nothing to run, so it takes
+// the page only from the buddy allocator, never reclaiming
+// or stealing from other CPUs.
+void
+kzrefill(void)
+{
+  struct run *r;
+  int i;
+
+  if(zpool.nfree >= NZPOOL)
+    return;
+  push_off();
+  i = zonealloc(CPUNODE(cpuid()), 0);
+  pop_off();
+  if(i < 0)
+    return;
+  refcnt[i] = 1;
+  r = REF2PA(i);
+  memset(r, 0, PGSIZE);
+  give(&zpool, r, r, 1);
+}
+
+// Allocate 2^order physically contiguous pages, aligned to
+// their size. Returns 0 if there is no such block free, even
+// after taking back the pages the CPUs hold.
+void *
+kalloc_pages(int order)
+{
+  int i, node;
+
+  if(order < 0 || order > MAXORDER)
+    panic("kalloc_pages");
+  if(order == 0)
+    return kalloc();
+
+  push_off();
+  node = CPUNODE(cpuid());
+  pop_off();
+  if((i = zonealloc(node, order)) < 0){
+    drain();
+    if((i = zonealloc(node, order)) < 0)
+      return 0;
+  }
+  refcnt[i] = 1;
+  account(REF2PA(i));
+#ifndef NOJUNK
+  memset(REF2PA(i), 5, PGSIZE << order); // fill with junk
+#endif
+  return REF2PA(i);
+}
+
+// Drop a reference to a block from kalloc_pages(order),
+// and free it if that was the last.
+void
+kfree_pages(void *pa, int order)
+{
+  struct zone *z;
+  int n;
+
+  if(order == 0){
+    kfree(pa);
+    return;
+  }
+  if(order < 0 || order > MAXORDER || PA2REF(pa) % (1 << order) != 0 ||
+     (char*)pa < end || (uint64)pa + (PGSIZE << order) > PHYSTOP)
+    panic("kfree_pages");
+  if((n = __sync_sub_and_fetch(&refcnt[PA2REF(pa)], 1)) > 0)
+    return;
+  if(n < 0)
+    panic("kfree_pages: free block");
+
+#ifndef NOJUNK
+  memset(pa, 1, PGSIZE << order);
+#endif
+  z = pagezone(PA2REF(pa));
+  acquire(&z->lock);
+  buddyfree(z, PA2REF(pa), order);
+  release(&z->lock);
+}
+
+// Turn a block from kalloc_pages(order) into 2^order
+// pages, each to be kfree()d on its own.
+void
+ksplit_pages(void *pa, int order)
+{
+  int i;
+
+  if(refcnt[PA2REF(pa)] != 1)
+    panic("ksplit_pages");
+  for(i = 1; i < (1 << order); i++)
+    refcnt[PA2REF(pa) + i] = 1;
+}
+
+// Fill in *st with counts of free memory, and of the pages
+// kalloc.c holds zeroed. Drains the CPUs' free lists first,
+// so that the counts show how far free memory can join up.
+void
+kmemstat(struct memstat *st)
+{
+  struct zone *z;
+  int i, n;
+
+  drain();
+  memset(st, 0, sizeof(*st));
+  st->nnode = nnode;
+  for(n = 0; n < nnode; n++){
+    z = &zones[n];
+    acquire(&z->lock);
+    for(i = 0; i <= MAXORDER; i++){
+      st->nfree[i] += z->nfree[i];
+      st->nodefree[n] += z->nfree[i] << i;
+    }
+    release(&z->lock);
+  }
+  for(i = 0; i < NCPU; i++){
+    st->cached += kcpu[i].nfree;
+    st->zeroed += zcpu[i].nfree;
+    st->hits[CPUNODE(i)] += hits[i];
+    st->misses[CPUNODE(i)] += misses[i];
+  }
+  st->zeroed += zpool.nfree;
+  st->total = (PHYSTOP - PGROUNDUP((uint64)end)) / PGSIZE;
+}
@@ -19,17 +19,22 @@ main()
     kinit();         // physical page allocator
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
+    asidinit();      // address-space IDs
     procinit();      // process table
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
+    pgcacheinit();   // shared program pages
     iinit();         // inode table
     fileinit();      // file table
+    pipeinit();      // pipe cache
     virtio_disk_init(); // emulated hard disk
+    swapinit();      // swap space
     userinit();      // first user process
     InitQueue();     //For MLFQ
+    schedtraceinit(); // scheduler event trace
     __sync_synchronize();
     started = 1;
   } else {
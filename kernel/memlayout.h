@@ -17,12 +17,25 @@
 // end -- start of kernel page allocation area
 // PHYSTOP -- end RAM used by the kernel
 
+// With SHAREDPT, the kernel runs on each process's own page
+// table, which shares the kernel's mappings of the 1 GiB from
+// KERNBASE (see proc_pagetable()), so that copyin() and
+// copyout() can use user addresses directly. Everything the
+// kernel maps has to fit in there: the devices are mapped at
+// KDEV plus their physical addresses, and the kernel stacks
+// just below KERNTOP.
+#ifdef SHAREDPT
+#define KDEV 0x90000000L
+#else
+#define KDEV 0L
+#endif
+
 // qemu puts UART registers here in physical memory.
-#define UART0 0x10000000L
+#define UART0 (KDEV + 0x10000000L)
 #define UART0_IRQ 10
 
 // virtio mmio interface
-#define VIRTIO0 0x10001000
+#define VIRTIO0 (KDEV + 0x10001000L)
 #define VIRTIO0_IRQ 1
 
 // core local interruptor (CLINT), which contains the timer.
@@ -31,7 +44,7 @@
 #define CLINT_MTIME (CLINT + 0xBFF8) // cycles since boot.
 
 // qemu puts platform-level interrupt controller (PLIC) here.
-#define PLIC 0x0c000000L
+#define PLIC (KDEV + 0x0c000000L)
 #define PLIC_PRIORITY (PLIC + 0x0)
 #define PLIC_PENDING (PLIC + 0x1000)
 #define PLIC_MENABLE(hart) (PLIC + 0x2000 + (hart)*0x100)
@@ -53,15 +66,36 @@
 
 // map kernel stacks beneath the trampoline,
 // each surrounded by invalid guard pages.
+#ifdef SHAREDPT
+#define KERNTOP (KERNBASE + (1L << 30))
+#define KSTACK(p) (KERNTOP - ((p)+1)* 2*PGSIZE)
+#else
 #define KSTACK(p) (TRAMPOLINE - ((p)+1)* 2*PGSIZE)
+#endif
 
 // User memory layout.
 // Address zero first:
 //   text
 //   original data and bss
-//   fixed-size stack
 //   expandable heap
 //   ...
+//   mmap()ed memory, top down
+//   an unmapped guard page
+//   stack, from USTACKBASE up to USTACK, filled in on demand
+//   ...
 //   TRAPFRAME (p->trapframe, used by the trampoline)
 //   TRAMPOLINE (the same page as in the kernel)
 #define TRAPFRAME (TRAMPOLINE - PGSIZE)
+
+// the stack ends below the last 1 GiB, since exec() shares
+// the page-table pages of that with the old program's.
+#define USTACK (MAXVA - (1L << 30))
+#define USTACKBASE (USTACK - NSTACK*PGSIZE)
+
+// the text, data and heap end below USERTOP; with SHAREDPT,
+// below the kernel's part of the address space.
+#ifdef SHAREDPT
+#define USERTOP KERNBASE
+#else
+#define USERTOP (USTACKBASE - PGSIZE)
+#endif
@@ -0,0 +1,39 @@
+// Physical memory, as reported by the memstat() and procmem()
+// system calls. Shared with user space (user/fragtest.c,
+// user/free.c, user/ps.c).
+
+#define MAXORDER 10  // the biggest free block is 2^MAXORDER pages
+#define MAXNODE   4  // the most memory zones (nodes= boot parameter)
+
+struct memstat {
+  int nfree[MAXORDER+1];  // free blocks of 2^i pages
+  int cached;             // free pages on the per-CPU lists
+  int total;              // pages kalloc.c manages
+  int zeroed;             // zeroed pages kept for kzalloc()
+  int pgcache;            // program file pages in pgcache.c
+  int swapused;           // swap slots holding a page
+  int swaptotal;          // swap slots
+  int nnode;              // memory zones
+  int nodefree[MAXNODE];  // free pages in each zone's buddy lists
+  uint64 hits[MAXNODE];   // pages handed out on a node's CPUs from its zone
+  uint64 misses[MAXNODE]; // and from other zones
+};
+
+// procmem states, for enum procstate in kernel/proc.h.
+#define PM_UNUSED   0
+#define PM_USED     1
+#define PM_SLEEPING 2
+#define PM_RUNNABLE 3
+#define PM_RUNNING  4
+#define PM_ZOMBIE   5
+
+// One process's memory.
+struct procmem {
+  int pid;
+  int state;              // PM_*
+  char name[16];
+  uint64 sz;              // size of its memory below the mmap()s, in bytes
+  int rss;                // user pages resident in memory
+  int swapped;            // user pages out in swap
+  int ptpages;            // page-table pages
+};                        // -1 each if its page table may be changing
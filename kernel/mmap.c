@@ -0,0 +1,242 @@
+// Memory-mapped files and anonymous memory: mmap() and munmap().
+//
+// Each mapping is a VMA (see proc.h), placed top-down from just
+// below the user stack's guard page; growproc() keeps the heap
+// under the lowest one. Pages are filled on first touch by vmfault().
+// Whole file pages come from pgcache.c, so MAP_PRIVATE mappings
+// share them copy-on-write with each other and with running
+// programs, and MAP_SHARED mappings store into the cached page
+// itself; write() updates that page in place too, so the two
+// agree. munmap() and exit() write the dirty pages of a
+// MAP_SHARED mapping back to the file through the log.
+//
+// Anonymous MAP_SHARED memory is allocated by mmap(), so that
+// children forked later share all of it.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "proc.h"
+#include "defs.h"
+
+// Lowest address of p's mmap()ed memory, or of the user
+// stack's guard page if there is none.
+uint64
+vmabase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base;
+
+  base = USTACKBASE - PGSIZE;
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->flags && v->start >= p->sz && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Write the dirty pages of v in [start, end) back to v's file,
+// a few blocks per transaction, as filewrite() does. Stops at
+// the first error, e.g. if the file has been truncated.
+static void
+writeback(pagetable_t pagetable, struct vma *v, uint64 start, uint64 end)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  pte_t *pte;
+  uint64 va;
+  uint n, i, m;
+  int r;
+
+  for(va = start; va < end && va - v->start < v->filesz; va += PGSIZE){
+    if((pte = walk(pagetable, va, 0)) == 0)
+      continue;
+    if((*pte & PTE_V) == 0 || (*pte & PTE_D) == 0)
+      continue;
+    n = v->filesz - (va - v->start);
+    if(n > PGSIZE)
+      n = PGSIZE;
+    for(i = 0; i < n; i += m){
+      m = n - i;
+      if(m > max)
+        m = max;
+      begin_op();
+      ilock(v->ip);
+      r = writei(v->ip, 0, PTE2PA(*pte) + i, v->off + (va - v->start) + i, m);
+      iunlock(v->ip);
+      end_op();
+      if(r != m)
+        return;
+    }
+  }
+}
+
+// Remove [start, end) of v from pagetable, writing it back
+// first if it is MAP_SHARED, and shrink v to what is left.
+// The range must be all of v, or start or end at v's ends.
+// Must not be called inside a transaction.
+static void
+vmaunmap(pagetable_t pagetable, struct vma *v, uint64 start, uint64 end)
+{
+  struct inode *ip;
+  uint64 d;
+
+  if((v->flags & MAP_SHARED) && v->ip)
+    writeback(pagetable, v, start, end);
+  uvmunmap(pagetable, start, (PGROUNDUP(end) - start) / PGSIZE, 1);
+
+  if(start == v->start && end >= v->end){
+    ip = v->ip;
+    memset(v, 0, sizeof(*v));
+    if(ip){
+      begin_op();
+      iput(ip);
+      end_op();
+    }
+  } else if(start == v->start){
+    d = end - start;
+    v->off += d;
+    v->filesz = v->filesz > d ? v->filesz - d : 0;
+    v->start = end;
+  } else {
+    v->end = start;
+  }
+}
+
+// Remove all of the VMAs in vmas, and their pages in pagetable,
+// for exit() and exec(). Must not be called inside a transaction.
+void
+vmaunmapall(pagetable_t pagetable, struct vma *vmas)
+{
+  struct vma *v;
+
+  for(v = vmas; v < &vmas[NVMA]; v++)
+    if(v->flags)
+      vmaunmap(pagetable, v, v->start, v->end);
+}
+
+// Give fork()'s child np p's VMAs, and the pages p has faulted
+// in for its mmap()s. Returns 0, or -1 if out of memory, in
+// which case the caller must vmaunmapall() np's.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v;
+  int i;
+
+  for(i = 0; i < NVMA; i++){
+    v = &p->vmas[i];
+    if(v->flags == 0)
+      continue;
+    np->vmas[i] = *v;
+    if(v->ip)
+      idup(v->ip);
+    // exec()ed segments lie below sz, which uvmcopy() has done.
+    if(v->start >= p->sz &&
+       uvmcopy(p->pagetable, np->pagetable, v->start, v->end, v->flags & MAP_SHARED) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Map len bytes of f, from offset off, into the current
+// process, or anonymous zeroed memory if f is 0. addr is
+// only a hint, and ignored. Returns the address of the
+// mapping, or -1.
+uint64
+mmap(uint64 addr, int len, int prot, int flags, struct file *f, int off)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 va, a, size;
+
+  if(len <= 0 || off < 0 || off % PGSIZE != 0)
+    return -1;
+  // RISC-V has no encoding for a writable or executable page
+  // that can't be read, and R=W=X=0 means a page-table page.
+  if((prot & PROT_READ) == 0 || (prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)))
+    return -1;
+  flags &= MAP_SHARED|MAP_PRIVATE;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f){
+    if(f->type != FD_INODE || !f->readable)
+      return -1;
+    if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+      return -1;
+  }
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->flags == 0)
+      break;
+  if(v == &p->vmas[NVMA])
+    return -1;
+
+  size = PGROUNDUP((uint64)len);
+  va = vmabase(p);
+  if(va < size || va - size < PGROUNDUP(p->sz))
+    return -1;
+#ifdef SHAREDPT
+  if(va > KERNBASE && va - size < KERNTOP)
+    return -1;
+#endif
+  va -= size;
+
+  v->start = va;
+  v->end = va + size;
+  v->off = off;
+  v->filesz = 0;
+  // PTE_U always: see the note on user memory in exec.c.
+  v->perm = PTE_U|PTE_R;
+  if(prot & PROT_WRITE)
+    v->perm |= PTE_W;
+  if(prot & PROT_EXEC)
+    v->perm |= PTE_X;
+  v->flags = flags;
+  v->ip = 0;
+  if(f){
+    v->ip = idup(f->ip);
+    ilock(v->ip);
+    if(off < v->ip->size)
+      v->filesz = v->ip->size - off < len ? v->ip->size - off : len;
+    iunlock(v->ip);
+  } else if(flags == MAP_SHARED){
+    for(a = va; a < v->end; a += PGSIZE){
+      if(vmfault(p->pagetable, a) == 0){
+        vmaunmap(p->pagetable, v, v->start, v->end);
+        return -1;
+      }
+    }
+  }
+  return va;
+}
+
+// Remove [addr, addr+len) from the mmap() it lies in. The
+// range may be the whole mapping, or cut from either end of
+// it, but not a hole in the middle. Returns 0, or -1.
+int
+munmap(uint64 addr, int len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 end;
+
+  if(addr % PGSIZE != 0 || len <= 0)
+    return -1;
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->flags && addr >= v->start && addr < v->end)
+      break;
+  if(v == &p->vmas[NVMA])
+    return -1;
+  end = addr + PGROUNDUP((uint64)len);
+  if(end > v->end)
+    end = v->end;
+  if(addr != v->start && end != v->end)
+    return -1;
+  vmaunmap(p->pagetable, v, addr, end);
+  return 0;
+}
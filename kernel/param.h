@@ -1,8 +1,9 @@
-#define NPROC        64  // maximum number of processes
+#define MAXPROC    4096  // maximum number of processes
+#define PROCPAGES     8  // pages of RAM per process, for sizing maxproc
+#define NKSTACK       4  // freed kernel stacks each CPU keeps mapped for reuse
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // unused in-memory i-nodes kept cached
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
@@ -12,3 +13,13 @@
 #define FSSIZE       1000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define NMLFQ        5
+#define NPIDHASH     64  // buckets in the pid -> proc index
+#define MAXPID       0x7fffffff  // largest pid before nextpid wraps
+#define NSCHEDTRACE  256  // scheduler trace events kept per CPU
+#define KBATCH       32  // pages moved between a CPU's free list and the pool
+#define NZPOOL       64  // pre-zeroed pages idle CPUs keep for kzalloc()
+#define NZCPU         8  // zeroed pages each CPU keeps from kzfree()
+#define NPGCACHE    512  // program file pages shared through pgcache.c
+#define NVMA          16 // demand-paged ranges per process (ELF segments, stack, mmap())
+#define NSTACK       256 // pages a user stack may grow to
+#define NSWAP       2048 // pages of swap space on disk, after the file system (the Makefile reads this)
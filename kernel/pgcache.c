@@ -0,0 +1,227 @@
+// Page cache for program files.
+//
+// Processes running the same program, or mmap()ing the same
+// file, share the pages that come whole from the file (see
+// vmfault()); writable ones are mapped copy-on-write, except
+// in MAP_SHARED mappings (see mmap.c). Entries
+// are keyed by in-memory inode and file offset, and each holds
+// a reference on its page (kalloc.c counts them).
+//
+// Writing a file updates its cached pages in place, so that
+// MAP_SHARED mappings of them see the write, and don't write
+// stale data back over it later. Truncating a file, or freeing
+// its in-memory inode, drops its entries; processes that
+// already map the old pages keep them. When memory runs out,
+// kalloc() calls pgcache_reclaim() to free the pages only the
+// cache holds.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "defs.h"
+
+#define NPGHASH (NPGCACHE/8)
+
+struct pgent {
+  struct inode *ip;     // 0 if free
+  uint off;
+  uint64 pa;
+  struct pgent *next;   // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct pgent ent[NPGCACHE];
+  struct pgent *hash[NPGHASH];
+  int hand;             // next entry victim() looks at
+} pgcache;
+
+void
+pgcacheinit(void)
+{
+  initlock(&pgcache.lock, "pgcache");
+}
+
+static struct pgent**
+bucket(struct inode *ip, uint off)
+{
+  return &pgcache.hash[((uint64)ip / sizeof(*ip) + off / PGSIZE) % NPGHASH];
+}
+
+static struct pgent*
+lookup(struct inode *ip, uint off)
+{
+  struct pgent *e;
+
+  for(e = *bucket(ip, off); e; e = e->next)
+    if(e->ip == ip && e->off == off)
+      return e;
+  return 0;
+}
+
+// Remove e and drop its reference to its page.
+static void
+drop(struct pgent *e)
+{
+  struct pgent **pp;
+
+  for(pp = bucket(e->ip, e->off); *pp != e; pp = &(*pp)->next)
+    ;
+  *pp = e->next;
+  kfree((void*)e->pa);
+  e->ip = 0;
+}
+
+// Find an entry to fill: a free one, or else one whose page
+// no process maps any more. Returns 0 if all are in use.
+static struct pgent*
+victim(void)
+{
+  struct pgent *e;
+
+  for(int i = 0; i < NPGCACHE; i++){
+    e = &pgcache.ent[pgcache.hand];
+    pgcache.hand = (pgcache.hand + 1) % NPGCACHE;
+    if(e->ip == 0)
+      return e;
+    if(krefcount((void*)e->pa) == 1){
+      drop(e);
+      return e;
+    }
+  }
+  return 0;
+}
+
+// How many pages the cache holds.
+int
+pgcache_count(void)
+{
+  int i, n;
+
+  n = 0;
+  acquire(&pgcache.lock);
+  for(i = 0; i < NPGCACHE; i++)
+    if(pgcache.ent[i].ip)
+      n++;
+  release(&pgcache.lock);
+  return n;
+}
+
+// Return the physical address of a page holding ip's contents
+// from offset off, with a reference for the caller, reading it
+// in if it isn't cached. The whole page must lie within the file.
+// If every entry's page is mapped, the page isn't cached; a
+// MAP_SHARED mapping (shared set) must have the cached page, so
+// that it shares stores with other processes, and gets 0.
+// Returns 0 if out of memory or the read fails.
+uint64
+pgcache_get(struct inode *ip, uint off, int shared)
+{
+  struct pgent *e;
+  char *mem;
+
+  acquire(&pgcache.lock);
+  if((e = lookup(ip, off)) != 0){
+    kdup((void*)e->pa);
+    release(&pgcache.lock);
+    return e->pa;
+  }
+  release(&pgcache.lock);
+
+  if((mem = kalloc()) == 0)
+    return 0;
+  ilock(ip);
+  if(readi(ip, 0, (uint64)mem, off, PGSIZE) != PGSIZE){
+    iunlock(ip);
+    kfree(mem);
+    return 0;
+  }
+
+  // still holding ip->lock, so no write to the
+  // file can come between the read and the insert.
+  acquire(&pgcache.lock);
+  if((e = lookup(ip, off)) != 0){
+    // another process read it in meanwhile.
+    kdup((void*)e->pa);
+    release(&pgcache.lock);
+    iunlock(ip);
+    kfree(mem);
+    return e->pa;
+  }
+  if((e = victim()) != 0){
+    e->ip = ip;
+    e->off = off;
+    e->pa = (uint64)mem;
+    e->next = *bucket(ip, off);
+    *bucket(ip, off) = e;
+    kdup(mem);
+    ip->pgcached = 1;
+  }
+  release(&pgcache.lock);
+  iunlock(ip);
+  if(e == 0 && shared){
+    kfree(mem);
+    return 0;
+  }
+  return (uint64)mem;
+}
+
+// writei() has written the n bytes at src to ip from offset
+// off: copy them into the cached pages they fall in. Caller
+// holds ip->lock.
+void
+pgcache_write(struct inode *ip, uint off, char *src, uint n)
+{
+  struct pgent *e;
+  uint s, t;
+
+  acquire(&pgcache.lock);
+  for(e = pgcache.ent; e < &pgcache.ent[NPGCACHE]; e++){
+    if(e->ip != ip || e->off >= off + n || e->off + PGSIZE <= off)
+      continue;
+    s = off > e->off ? off : e->off;
+    t = off + n < e->off + PGSIZE ? off + n : e->off + PGSIZE;
+    memmove((char*)e->pa + (s - e->off), src + (s - off), t - s);
+  }
+  release(&pgcache.lock);
+}
+
+// Drop the cached pages of ip, whose contents or identity
+// are changing. Caller must hold ip->lock, or itable.lock
+// if ip is unreferenced.
+void
+pgcache_invalidate(struct inode *ip)
+{
+  struct pgent *e;
+
+  acquire(&pgcache.lock);
+  for(e = pgcache.ent; e < &pgcache.ent[NPGCACHE]; e++)
+    if(e->ip == ip)
+      drop(e);
+  ip->pgcached = 0;
+  release(&pgcache.lock);
+}
+
+// Free the cached pages that no process maps.
+// Returns how many were freed.
+int
+pgcache_reclaim(void)
+{
+  struct pgent *e;
+  int n = 0;
+
+  acquire(&pgcache.lock);
+  for(e = pgcache.ent; e < &pgcache.ent[NPGCACHE]; e++){
+    if(e->ip && krefcount((void*)e->pa) == 1){
+      drop(e);
+      n++;
+    }
+  }
+  release(&pgcache.lock);
+  return n;
+}
@@ -5,10 +5,38 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "schedtrace.h"
+#include "slab.h"
+#include "memstat.h"
+#include "fcntl.h"
 
 struct cpu cpus[NCPU];
 
-struct proc proc[NPROC];
+// Process descriptors come from proccache as processes are
+// created and go back to it when they are reaped, so only
+// processes that exist take up memory, and a walk of allproc
+// costs the number of live processes, not the most there
+// could be. Walkers hold ptable.lock for the whole walk, so a
+// descriptor can't be freed under them.
+// Lock order: wait_lock, ptable.lock, p->lock, pid_lock.
+struct {
+    struct spinlock lock;
+    struct proc *allproc;        // live descriptors, by allnext/allprev
+    struct proc *alltail;        // last on allproc
+    int nproc;                   // length of allproc
+    uint64 kslots[MAXPROC / 64]; // KSTACK() slots in use
+    // slots of freed kernel stacks that each CPU keeps, still
+    // mapped, for new processes; see kstackalloc().
+    int kcache[NCPU][NKSTACK];
+    int nkcache[NCPU];
+} ptable;
+
+int maxproc; // cap on processes, set by procinit()
+static struct kmem_cache proccache;
+
+// Bumped whenever a kernel stack is mapped or unmapped,
+// so harts can tell their TLB may be stale; see kstacksync().
+static uint kstackgen;
 
 struct proc *initproc;
 
@@ -17,8 +45,15 @@ struct Queue mlfq[1000];
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// pid -> proc index, chained through p->pidnext.
+// pid_lock protects the chains and p->pidnext.
+// pid_lock may be acquired while holding a p->lock,
+// so never acquire a p->lock while holding pid_lock.
+struct proc *pidhash[NPIDHASH];
+
 extern void forkret(void);
 static void freeproc(struct proc *p);
+static void putproc(struct proc *p);
 
 extern char trampoline[]; // trampoline.S
 
@@ -28,18 +63,16 @@ extern char trampoline[]; // trampoline.S
 // must be acquired before any p->lock.
 struct spinlock wait_lock;
 
-// Allocate a page for each process's kernel stack.
-// Map it high in memory, followed by an invalid
-// guard page.
-
+// MLFQ run queues, linked through p->qnext.
+// ptable.lock must be held.
 void push(struct Queue *q, struct proc *el)
 {
-    // if(q->sz >= NPROC)
-    // {
-    //     panic("Too many processes stacked!!");
-    // }
-    q->qarr[q->tail] = el;
-    q->tail = (q->tail + 1) % NPROC;
+    el->qnext = 0;
+    if (q->tail)
+        q->tail->qnext = el;
+    else
+        q->head = el;
+    q->tail = el;
     q->sz++;
 }
 
@@ -49,7 +82,9 @@ void pop(struct Queue *q)
     {
         panic("Queue is empty!!");
     }
-    q->head = (q->head + 1) % NPROC;
+    q->head = q->head->qnext;
+    if (q->head == 0)
+        q->tail = 0;
     q->sz--;
 }
 
@@ -59,26 +94,27 @@ struct proc *front(struct Queue *q)
     {
         return 0;
     }
-    return q->qarr[q->head];
+    return q->head;
 }
 
-void eraseq(struct Queue *q, int pid)
+void eraseq(struct Queue *q, struct proc *p)
 {
-    for (int curr = q->head; curr != q->tail; curr = (curr + 1) % (NPROC + 5))
+    struct proc *prev = 0;
+
+    for (struct proc *curr = q->head; curr; prev = curr, curr = curr->qnext)
     {
-        if (q->qarr[curr]->pid == pid)
+        if (curr == p)
         {
-            struct proc *temp = q->qarr[curr];
-            q->qarr[curr] = q->qarr[(curr + 1) % (NPROC + 1)];
-            q->qarr[(curr + 1) % (NPROC + 1)] = temp;
+            if (prev)
+                prev->qnext = curr->qnext;
+            else
+                q->head = curr->qnext;
+            if (q->tail == curr)
+                q->tail = prev;
+            q->sz--;
+            return;
         }
     }
-    q->tail--;
-    q->sz--;
-    if (q->tail < 0)
-    {
-        q->tail = NPROC;
-    }
 }
 
 void InitQueue()
@@ -91,32 +127,146 @@ void InitQueue()
     }
 }
 
-void proc_mapstacks(pagetable_t kpgtbl)
+// initialize the proc table at boot time.
+void procinit(void)
+{
+    extern char end[];
+
+    initlock(&pid_lock, "nextpid");
+    initlock(&wait_lock, "wait_lock");
+    initlock(&ptable.lock, "ptable");
+    kmem_cache_init(&proccache, "proc", sizeof(struct proc));
+
+    // Each process needs at least PROCPAGES pages of RAM
+    // (kernel stack, trapframe, page-table pages, a little
+    // user memory), so there is no point allowing more.
+    maxproc = (PHYSTOP - PGROUNDUP((uint64)end)) / PGSIZE / PROCPAGES;
+    if (maxproc > MAXPROC)
+        maxproc = MAXPROC;
+}
+
+// Claim a free KSTACK() slot. Caller must hold ptable.lock,
+// and there must be one: there are MAXPROC slots and at most
+// maxproc processes.
+static int
+kslotalloc(void)
 {
-    struct proc *p;
+    int i, b;
+
+    for (i = 0; ptable.kslots[i] == ~0UL; i++)
+        ;
+    for (b = 0; ptable.kslots[i] & (1UL << b); b++)
+        ;
+    ptable.kslots[i] |= 1UL << b;
+    return i * 64 + b;
+}
 
-    for (p = proc; p < &proc[NPROC]; p++)
+// Get a mapped kernel stack for a new process, and return
+// its slot: one that this CPU, or else another, kept when a
+// process was freed, which needs no mapping and no TLB flush,
+// or else a new one. Returns -1 if out of memory. Caller must
+// hold ptable.lock.
+static int
+kstackalloc(void)
+{
+    int i, c, slot;
+
+    for (i = 0; i < NCPU; i++)
     {
-        char *pa = kalloc();
-        if (pa == 0)
-            panic("kalloc");
-        uint64 va = KSTACK((int)(p - proc));
-        kvmmap(kpgtbl, va, (uint64)pa, PGSIZE, PTE_R | PTE_W);
+        c = (cpuid() + i) % NCPU;
+        if (ptable.nkcache[c] > 0)
+            return ptable.kcache[c][--ptable.nkcache[c]];
+    }
+    // none kept, so there are fewer than maxproc slots in use.
+    slot = kslotalloc();
+    if (kvmmapstack(KSTACK(slot)) < 0)
+    {
+        ptable.kslots[slot / 64] &= ~(1UL << (slot % 64));
+        return -1;
     }
+    __sync_fetch_and_add(&kstackgen, 1);
+    return slot;
 }
 
-// initialize the proc table at boot time.
-void procinit(void)
+// Give back a freed process's kernel stack: keep it mapped
+// on this CPU's list, or if that is full, unmap it and free
+// its slot. Caller must hold ptable.lock.
+static void
+kstackfree(int slot)
 {
-    struct proc *p;
+    int c = cpuid();
 
-    initlock(&pid_lock, "nextpid");
-    initlock(&wait_lock, "wait_lock");
-    for (p = proc; p < &proc[NPROC]; p++)
+    if (ptable.nkcache[c] < NKSTACK)
     {
-        initlock(&p->lock, "proc");
-        p->kstack = KSTACK((int)(p - proc));
+        ptable.kcache[c][ptable.nkcache[c]++] = slot;
+        return;
     }
+    kvmunmapstack(KSTACK(slot));
+    __sync_fetch_and_add(&kstackgen, 1);
+    ptable.kslots[slot / 64] &= ~(1UL << (slot % 64));
+}
+
+// Flush this hart's TLB if a kernel stack was mapped or
+// unmapped since it last did, since the slot may have been
+// reused. A hart only touches another process's kernel stack
+// by running it, so the scheduler calls this before swtch().
+// Interrupts must be disabled.
+static void
+kstacksync(struct cpu *c)
+{
+    uint gen = kstackgen;
+
+    if (c->kstackgen != gen)
+    {
+        sfence_vma();
+        c->kstackgen = gen;
+    }
+}
+
+// Switch to p, which the caller has made RUNNING, and
+// come back here when p gives up the CPU. With SHAREDPT, p
+// runs on its own page table in the kernel too, and the
+// scheduler on the kernel's.
+static void
+runproc(struct cpu *c, struct proc *p)
+{
+    kstacksync(c);
+#ifdef SHAREDPT
+    uvmswitch(p);
+#endif
+    swtch(&c->context, &p->context);
+#ifdef SHAREDPT
+    uvmswitch(0);
+#endif
+}
+
+// Append p to allproc. Caller must hold ptable.lock.
+static void
+linkproc(struct proc *p)
+{
+    p->allnext = 0;
+    p->allprev = ptable.alltail;
+    if (ptable.alltail)
+        ptable.alltail->allnext = p;
+    else
+        ptable.allproc = p;
+    ptable.alltail = p;
+}
+
+// Take p off allproc. Caller must hold ptable.lock.
+static void
+unlinkproc(struct proc *p)
+{
+    if (p->allprev)
+        p->allprev->allnext = p->allnext;
+    else
+        ptable.allproc = p->allnext;
+    if (p->allnext)
+        p->allnext->allprev = p->allprev;
+    else
+        ptable.alltail = p->allprev;
+    p->allnext = 0;
+    p->allprev = 0;
 }
 
 // Must be called with interrupts disabled,
@@ -149,42 +299,212 @@ myproc(void)
     return p;
 }
 
-int allocpid()
+// Push np onto the front of a children or zombies list.
+// Caller must hold wait_lock.
+static void
+listpush(struct proc **head, struct proc *np)
+{
+    np->sibprev = 0;
+    np->sibnext = *head;
+    if (*head)
+        (*head)->sibprev = np;
+    *head = np;
+}
+
+// Unlink np from the children or zombies list at head.
+// Caller must hold wait_lock.
+static void
+listremove(struct proc **head, struct proc *np)
+{
+    if (np->sibprev)
+        np->sibprev->sibnext = np->sibnext;
+    else
+        *head = np->sibnext;
+    if (np->sibnext)
+        np->sibnext->sibprev = np->sibprev;
+    np->sibnext = 0;
+    np->sibprev = 0;
+}
+
+// Look pid up in pidhash. Caller must hold pid_lock.
+static struct proc *
+pidlookup(int pid)
+{
+    struct proc *p;
+
+    for (p = pidhash[pid % NPIDHASH]; p; p = p->pidnext)
+    {
+        if (p->pid == pid)
+            return p;
+    }
+    return 0;
+}
+
+// Give p a fresh pid and enter it in pidhash.
+// After nextpid wraps, skip pids that are still in use.
+void allocpid(struct proc *p)
 {
     int pid;
 
     acquire(&pid_lock);
-    pid = nextpid;
-    nextpid = nextpid + 1;
+    do
+    {
+        pid = nextpid;
+        nextpid = (nextpid == MAXPID) ? 1 : nextpid + 1;
+    } while (pidlookup(pid));
+    p->pid = pid;
+    p->pidnext = pidhash[pid % NPIDHASH];
+    pidhash[pid % NPIDHASH] = p;
     release(&pid_lock);
+}
 
-    return pid;
+// Remove p from pidhash.
+static void
+freepid(struct proc *p)
+{
+    struct proc **pp;
+
+    acquire(&pid_lock);
+    for (pp = &pidhash[p->pid % NPIDHASH]; *pp; pp = &(*pp)->pidnext)
+    {
+        if (*pp == p)
+        {
+            *pp = p->pidnext;
+            break;
+        }
+    }
+    release(&pid_lock);
+    p->pidnext = 0;
+    p->pid = 0;
 }
 
-// Look in the process table for an UNUSED proc.
-// If found, initialize state required to run in the kernel,
-// and return with p->lock held.
-// If there are no free procs, or a memory allocation fails, return 0.
+// Find the live process with the given pid.
+// Returns it with p->lock held, or 0 if there is none.
+// ptable.lock keeps p from being freed between dropping
+// pid_lock and taking p->lock, but it may have been reaped,
+// so check the pid again.
 static struct proc *
-allocproc(void)
+findproc(int pid)
 {
     struct proc *p;
-    for (p = proc; p < &proc[NPROC]; p++)
+
+    if (pid <= 0)
+        return 0;
+    acquire(&ptable.lock);
+    acquire(&pid_lock);
+    p = pidlookup(pid);
+    release(&pid_lock);
+    if (p)
     {
         acquire(&p->lock);
-        if (p->state == UNUSED)
-        {
-            goto found;
-        }
-        else
+        if (p->pid != pid || p->state == UNUSED)
         {
             release(&p->lock);
+            p = 0;
         }
     }
-    return 0;
+    release(&ptable.lock);
+    return p;
+}
+
+// Find the process with the smallest pid >= pid, for the
+// clock hand in swap.c and for procmem(), which go in
+// pid order.
+// Returns it with p->lock held, or 0 if there is none.
+struct proc *procfrom(int pid)
+{
+    struct proc *p, *best = 0;
+
+    acquire(&ptable.lock);
+    for (p = ptable.allproc; p != 0; p = p->allnext)
+        if (p->pid >= pid && (best == 0 || p->pid < best->pid))
+            best = p;
+    if (best)
+        acquire(&best->lock);
+    release(&ptable.lock);
+    return best;
+}
+
+static int pmstate[] = {
+    [UNUSED] PM_UNUSED,
+    [USED] PM_USED,
+    [SLEEPING] PM_SLEEPING,
+    [RUNNABLE] PM_RUNNABLE,
+    [RUNNING] PM_RUNNING,
+    [ZOMBIE] PM_ZOMBIE,
+};
+
+// Copy out a struct procmem for each process, in pid order,
+// to the array of n at user address addr. Returns how many,
+// or -1. Only page tables that nothing is changing are
+// counted: the caller's own, and those of processes that
+// are asleep, exited, or stopped outside the kernel.
+int procmem(uint64 addr, int n)
+{
+    struct proc *p;
+    struct procmem st;
+    int i, pid;
+
+    pid = 1;
+    for (i = 0; i < n && (p = procfrom(pid)) != 0; i++)
+    {
+        memset(&st, 0, sizeof(st));
+        st.pid = p->pid;
+        st.state = pmstate[p->state];
+        safestrcpy(st.name, p->name, sizeof(st.name));
+        st.sz = p->sz;
+        if (p->pagetable && (p == myproc() || p->state == SLEEPING || p->state == ZOMBIE ||
+                             (p->state == RUNNABLE && !p->insyscall)))
+            uvmstat(p->pagetable, &st);
+        else
+            st.rss = st.swapped = st.ptpages = -1;
+        pid = p->pid + 1;
+        release(&p->lock);
+        if (copyout(myproc()->pagetable, addr + i * sizeof(st), (char *)&st, sizeof(st)) < 0)
+            return -1;
+    }
+    return i;
+}
 
-found:
-    p->pid = allocpid();
+// Make a new process descriptor with a mapped kernel stack.
+// If that works, initialize state required to run in the kernel,
+// and return with p->lock held.
+// At maxproc, or if a memory allocation fails, return 0.
+static struct proc *
+allocproc(void)
+{
+    struct proc *p;
+
+    if ((p = kmem_cache_alloc(&proccache)) == 0)
+        return 0;
+    memset(p, 0, sizeof(*p));
+    initlock(&p->lock, "proc");
+
+    acquire(&ptable.lock);
+    if (ptable.nproc >= maxproc)
+    {
+        release(&ptable.lock);
+        kmem_cache_free(&proccache, p);
+        return 0;
+    }
+    // A kernel stack high in memory,
+    // followed by an invalid guard page.
+    if ((p->kslot = kstackalloc()) < 0)
+    {
+        release(&ptable.lock);
+        kmem_cache_free(&proccache, p);
+        return 0;
+    }
+    p->kstack = KSTACK(p->kslot);
+    linkproc(p);
+    ptable.nproc++;
+
+    // p is UNUSED, so walkers ignore it, but take its
+    // lock before they can see it's USED.
+    acquire(&p->lock);
+    release(&ptable.lock);
+
+    allocpid(p);
     p->create_time = ticks;
     p->state = USED;
     p->static_priority = STATIC_PRIORITY;
@@ -199,11 +519,13 @@ found:
     p->level_enter = ticks;
     for(int i=0; i<NMLFQ; i++)
         p->level_times[i] = 0;
+    p->last_cpu = -1;
     // Allocate a trapframe page.
     if ((p->trapframe = (struct trapframe *)kalloc()) == 0)
     {
         freeproc(p);
         release(&p->lock);
+        putproc(p);
         return 0;
     }
 
@@ -213,6 +535,7 @@ found:
     {
         freeproc(p);
         release(&p->lock);
+        putproc(p);
         return 0;
     }
 
@@ -230,9 +553,10 @@ found:
     return p;
 }
 
-// free a proc structure and the data hanging from it,
-// including user pages.
-// p->lock must be held.
+// free the data hanging from a proc structure,
+// including user pages, and mark it UNUSED.
+// p->lock must be held. Once it is released,
+// putproc() frees the structure itself.
 static void
 freeproc(struct proc *p)
 {
@@ -243,7 +567,8 @@ freeproc(struct proc *p)
         proc_freepagetable(p->pagetable, p->sz);
     p->pagetable = 0;
     p->sz = 0;
-    p->pid = 0;
+    if (p->pid)
+        freepid(p);
     p->parent = 0;
     p->name[0] = 0;
     p->chan = 0;
@@ -252,6 +577,21 @@ freeproc(struct proc *p)
     p->state = UNUSED;
 }
 
+// Take a freeproc()ed p off allproc and give back its kernel
+// stack and descriptor. p->lock must not be held.
+static void
+putproc(struct proc *p)
+{
+    acquire(&ptable.lock);
+    if (p->in_queue)
+        eraseq(&mlfq[p->queue_stage], p);
+    unlinkproc(p);
+    ptable.nproc--;
+    kstackfree(p->kslot);
+    release(&ptable.lock);
+    kmem_cache_free(&proccache, p);
+}
+
 // Create a user page table for a given process,
 // with no user memory, but with trampoline pages.
 pagetable_t
@@ -284,6 +624,11 @@ proc_pagetable(struct proc *p)
         return 0;
     }
 
+#ifdef SHAREDPT
+    // the kernel runs on this page table too.
+    kvmshare(pagetable);
+#endif
+
     return pagetable;
 }
 
@@ -293,6 +638,38 @@ void proc_freepagetable(pagetable_t pagetable, uint64 sz)
 {
     uvmunmap(pagetable, TRAMPOLINE, 1, 0);
     uvmunmap(pagetable, TRAPFRAME, 1, 0);
+#ifdef SHAREDPT
+    kvmunshare(pagetable);
+#endif
+    uvmfree(pagetable, sz);
+}
+
+// A page table for exec() to build p's new user memory in.
+// It shares p's trampoline and trapframe mappings, and with
+// SHAREDPT the kernel's, rather than making its own; exec()
+// moves the rest into p's page table with uvmadopt().
+pagetable_t
+proc_execpagetable(struct proc *p)
+{
+    pagetable_t pagetable;
+
+    if ((pagetable = uvmcreate()) == 0)
+        return 0;
+    pagetable[PX(2, TRAMPOLINE)] = p->pagetable[PX(2, TRAMPOLINE)];
+#ifdef SHAREDPT
+    kvmshare(pagetable);
+#endif
+    return pagetable;
+}
+
+// Free a page table from proc_execpagetable() that exec()
+// gave up on, and the user memory below sz in it.
+void proc_freeexecpagetable(pagetable_t pagetable, uint64 sz)
+{
+    pagetable[PX(2, TRAMPOLINE)] = 0;
+#ifdef SHAREDPT
+    kvmunshare(pagetable);
+#endif
     uvmfree(pagetable, sz);
 }
 
@@ -333,22 +710,28 @@ void userinit(void)
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; vmfault() allocates each
+// page when it is first touched.
 // Return 0 on success, -1 on failure.
 int growproc(int n)
 {
-    uint sz;
+    uint64 sz;
     struct proc *p = myproc();
 
     sz = p->sz;
     if (n > 0)
     {
-        if ((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0)
+        if (sz + n > vmabase(p) || sz + n > USERTOP)
         {
             return -1;
         }
+        sz += n;
     }
     else if (n < 0)
     {
+        // a megapage that the new end cuts through comes apart.
+        if (PGROUNDUP(sz + n) % MEGAPGSIZE != 0 && uvmsplit(p->pagetable, PGROUNDUP(sz + n)) < 0)
+            return -1;
         sz = uvmdealloc(p->pagetable, sz, sz + n);
     }
     p->sz = sz;
@@ -369,14 +752,22 @@ int fork(void)
         return -1;
     }
 
+    // np is USED, so neither the scheduler nor wait() will
+    // touch it. Drop its lock so that copying the parent's
+    // memory runs with interrupts on and can be preempted.
+    release(&np->lock);
+
     // Copy user memory from parent to child.
-    if (uvmcopy(p->pagetable, np->pagetable, p->sz) < 0)
+    np->sz = p->sz;
+    if (uvmcopy(p->pagetable, np->pagetable, 0, p->sz, 0) < 0 || vmacopy(p, np) < 0)
     {
+        vmaunmapall(np->pagetable, np->vmas);
+        acquire(&np->lock);
         freeproc(np);
         release(&np->lock);
+        putproc(np);
         return -1;
     }
-    np->sz = p->sz;
     np->mask = p->mask;
 
     // copy saved user registers.
@@ -395,10 +786,83 @@ int fork(void)
 
     pid = np->pid;
 
+    acquire(&wait_lock);
+    np->parent = p;
+    listpush(&p->children, np);
+    release(&wait_lock);
+
+    acquire(&np->lock);
+    np->state = RUNNABLE;
+    np->runnable_time = ticks;
+    release(&np->lock);
+
+    return pid;
+}
+
+// Create a new process running the program at path with
+// arguments argv, as fork() and then exec() in the child would,
+// but without copying the parent's memory only to throw it
+// away. The child gets the parent's open files, changed by
+// the n file actions in acts. Returns the child's pid, or -1
+// if an action is bad or the program can't be run.
+int spawn(char *path, char **argv, struct spawnact *acts, int n)
+{
+    int i, fd, argc, pid;
+    struct proc *np;
+    struct proc *p = myproc();
+
+    for (i = 0; i < n; i++)
+    {
+        fd = acts[i].fd;
+        if (fd < 0 || fd >= NOFILE)
+            return -1;
+        if (acts[i].op == SPAWN_DUP)
+        {
+            if (acts[i].src < 0 || acts[i].src >= NOFILE || p->ofile[acts[i].src] == 0)
+                return -1;
+        }
+        else if (acts[i].op != SPAWN_CLOSE)
+            return -1;
+    }
+
+    if ((np = allocproc()) == 0)
+        return -1;
+    // as in fork(), np is USED and nothing else touches it.
     release(&np->lock);
 
+    // exec() leaves the rest of the registers alone.
+    *(np->trapframe) = *(p->trapframe);
+    safestrcpy(np->name, p->name, sizeof(p->name));
+    if ((argc = procexec(np, path, argv)) < 0)
+    {
+        acquire(&np->lock);
+        freeproc(np);
+        release(&np->lock);
+        putproc(np);
+        return -1;
+    }
+    np->trapframe->a0 = argc;
+    np->mask = p->mask;
+
+    for (i = 0; i < NOFILE; i++)
+        if (p->ofile[i])
+            np->ofile[i] = filedup(p->ofile[i]);
+    for (i = 0; i < n; i++)
+    {
+        fd = acts[i].fd;
+        if (np->ofile[fd])
+            fileclose(np->ofile[fd]);
+        np->ofile[fd] = 0;
+        if (acts[i].op == SPAWN_DUP)
+            np->ofile[fd] = filedup(p->ofile[acts[i].src]);
+    }
+    np->cwd = idup(p->cwd);
+
+    pid = np->pid;
+
     acquire(&wait_lock);
     np->parent = p;
+    listpush(&p->children, np);
     release(&wait_lock);
 
     acquire(&np->lock);
@@ -415,13 +879,21 @@ void reparent(struct proc *p)
 {
     struct proc *pp;
 
-    for (pp = proc; pp < &proc[NPROC]; pp++)
+    while ((pp = p->children) != 0)
     {
-        if (pp->parent == p)
+        listremove(&p->children, pp);
+        pp->parent = initproc;
+        listpush(&initproc->children, pp);
+    }
+    if (p->zombies)
+    {
+        while ((pp = p->zombies) != 0)
         {
+            listremove(&p->zombies, pp);
             pp->parent = initproc;
-            wakeup(initproc);
+            listpush(&initproc->zombies, pp);
         }
+        wakeup(initproc);
     }
 }
 
@@ -446,6 +918,9 @@ void exit(int status)
         }
     }
 
+    // Drop the program's segments and mmap()s.
+    vmaunmapall(p->pagetable, p->vmas);
+
     begin_op();
     iput(p->cwd);
     end_op();
@@ -468,6 +943,10 @@ void exit(int status)
     p->state = ZOMBIE;
     p->etime = ticks;
 
+    // Let the parent's wait() find us without a scan.
+    listremove(&p->parent->children, p);
+    listpush(&p->parent->zombies, p);
+
     release(&wait_lock);
 
     // Jump into the scheduler, never to return.
@@ -480,45 +959,42 @@ void exit(int status)
 int wait(uint64 addr)
 {
     struct proc *np;
-    int havekids, pid;
+    int pid;
     struct proc *p = myproc();
 
+    // copyout() below runs under spinlocks, where it
+    // must not fault; see vmfault().
+    if (addr != 0)
+        uvmprefault(p->pagetable, addr, sizeof(int));
+
     acquire(&wait_lock);
 
     for (;;)
     {
-        // Scan through table looking for exited children.
-        havekids = 0;
-        for (np = proc; np < &proc[NPROC]; np++)
+        // Reap the first exited child, if there is one.
+        if ((np = p->zombies) != 0)
         {
-            if (np->parent == p)
-            {
-                // make sure the child isn't still in exit() or swtch().
-                acquire(&np->lock);
+            // make sure the child isn't still in exit() or swtch().
+            acquire(&np->lock);
 
-                havekids = 1;
-                if (np->state == ZOMBIE)
-                {
-                    // Found one.
-                    pid = np->pid;
-                    if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                             sizeof(np->xstate)) < 0)
-                    {
-                        release(&np->lock);
-                        release(&wait_lock);
-                        return -1;
-                    }
-                    freeproc(np);
-                    release(&np->lock);
-                    release(&wait_lock);
-                    return pid;
-                }
+            pid = np->pid;
+            if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
+                                     sizeof(np->xstate)) < 0)
+            {
                 release(&np->lock);
+                release(&wait_lock);
+                return -1;
             }
+            listremove(&p->zombies, np);
+            freeproc(np);
+            release(&np->lock);
+            putproc(np);
+            release(&wait_lock);
+            return pid;
         }
 
         // No point waiting if we don't have any children.
-        if (!havekids || p->killed)
+        if (p->children == 0 || p->killed)
         {
             release(&wait_lock);
             return -1;
@@ -534,47 +1010,44 @@ int wait(uint64 addr)
 int waitx(uint64 addr, uint *rtime, uint *wtime)
 {
     struct proc *np;
-    int havekids, pid;
+    int pid;
     struct proc *p = myproc();
 
+    // copyout() below runs under spinlocks, where it
+    // must not fault; see vmfault().
+    if (addr != 0)
+        uvmprefault(p->pagetable, addr, sizeof(int));
+
     acquire(&wait_lock);
 
     for (;;)
     {
-        // Scan through table looking for exited children.
-        havekids = 0;
-        for (np = proc; np < &proc[NPROC]; np++)
+        // Reap the first exited child, if there is one.
+        if ((np = p->zombies) != 0)
         {
-            if (np->parent == p)
+            // make sure the child isn't still in exit() or swtch().
+            acquire(&np->lock);
+
+            pid = np->pid;
+            *rtime = np->rtime;
+            *wtime = np->etime - np->ctime - np->rtime;
+            if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
+                                     sizeof(np->xstate)) < 0)
             {
-                // make sure the child isn't still in exit() or swtch().
-                acquire(&np->lock);
-
-                havekids = 1;
-                if (np->state == ZOMBIE)
-                {
-                    // Found one.
-                    pid = np->pid;
-                    *rtime = np->rtime;
-                    *wtime = np->etime - np->ctime - np->rtime;
-                    if (addr != 0 && copyout(p->pagetable, addr, (char *)&np->xstate,
-                                             sizeof(np->xstate)) < 0)
-                    {
-                        release(&np->lock);
-                        release(&wait_lock);
-                        return -1;
-                    }
-                    freeproc(np);
-                    release(&np->lock);
-                    release(&wait_lock);
-                    return pid;
-                }
                 release(&np->lock);
+                release(&wait_lock);
+                return -1;
             }
+            listremove(&p->zombies, np);
+            freeproc(np);
+            release(&np->lock);
+            putproc(np);
+            release(&wait_lock);
+            return pid;
         }
 
         // No point waiting if we don't have any children.
-        if (!havekids || p->killed)
+        if (p->children == 0 || p->killed)
         {
             release(&wait_lock);
             return -1;
@@ -588,7 +1061,8 @@ int waitx(uint64 addr, uint *rtime, uint *wtime)
 void update_time()
 {
     struct proc *p;
-    for (p = proc; p < &proc[NPROC]; p++)
+    acquire(&ptable.lock);
+    for (p = ptable.allproc; p != 0; p = p->allnext)
     {
         acquire(&p->lock);
         if (p->state == RUNNING)
@@ -603,28 +1077,22 @@ void update_time()
         }
         release(&p->lock);
     }
+    release(&ptable.lock);
 }
 
 int setpriority(int newp, int pid)
 {
     struct proc *p;
     int oldp;
-    for (p = proc; p < &proc[NPROC]; p++)
-    {
-        acquire(&p->lock);
 
-        if (p->pid == pid)
-        {
-            oldp = p->static_priority;
-            p->static_priority = newp;
-            p->rtime = 0;
-            p->time_stopped = 0;
-            release(&p->lock);
-            return oldp;
-        }
-        release(&p->lock);
-    }
-    return -1;
+    if ((p = findproc(pid)) == 0)
+        return -1;
+    oldp = p->static_priority;
+    p->static_priority = newp;
+    p->rtime = 0;
+    p->time_stopped = 0;
+    release(&p->lock);
+    return oldp;
 }
 
 // Per-CPU process scheduler.
@@ -635,19 +1103,23 @@ int setpriority(int newp, int pid)
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
 
+// The MLFQ helpers below run with ptable.lock held.
 void ageing(void)
 {
-    for (struct proc *p = proc; p < &proc[NPROC]; p++)
+    for (struct proc *p = ptable.allproc; p != 0; p = p->allnext)
     {
         if (p->state == RUNNABLE && ticks - p->level_enter >= 128)
         {
             if (p->in_queue)
             {
-                eraseq(&mlfq[p->queue_stage], p->pid);
+                eraseq(&mlfq[p->queue_stage], p);
                 p->in_queue = 0;
             }
             if (p->queue_stage != 0)
+            {
                 p->queue_stage--;
+                schedtrace_log(SCHED_EV_AGE, p, p->queue_stage);
+            }
             p->level_enter = ticks;
         }
     }
@@ -679,12 +1151,17 @@ void scheduler(void)
 
     c->proc = 0;
 
+    // Each branch scans allproc under ptable.lock, takes the
+    // chosen process's lock before dropping ptable.lock, and
+    // starts the next scan over from the head, since p may be
+    // reaped as soon as its lock is released.
 #ifdef FCFS
     for (;;)
     {
         intr_on();
         struct proc *TempProc = 0;
-        for (p = proc; p < &proc[NPROC]; p++)
+        acquire(&ptable.lock);
+        for (p = ptable.allproc; p != 0; p = p->allnext)
         {
             acquire(&p->lock);
             if (p->state == RUNNABLE)
@@ -692,7 +1169,6 @@ void scheduler(void)
                 if (TempProc == 0 || TempProc->create_time > p->create_time)
                 {
                     TempProc = p;
-                    //acquire(&TempProc->lock);
                 }
             }
             release(&p->lock);
@@ -700,19 +1176,26 @@ void scheduler(void)
         if (TempProc)
         {
             acquire(&TempProc->lock);
+            release(&ptable.lock);
             if (TempProc->state == RUNNABLE)
             {
 
                 TempProc->state = RUNNING;
                 TempProc->level_enter = ticks;
                 c->proc = TempProc;
-                p->wtime1 += (ticks - p->runnable_time);
-                swtch(&c->context, &TempProc->context);
+                TempProc->wtime1 += (ticks - TempProc->runnable_time);
+                schedtrace_log(SCHED_EV_SWITCH_IN, TempProc, 0);
+                runproc(c, TempProc);
                 c->proc = 0;
-                p->level_enter = ticks;
+                TempProc->level_enter = ticks;
             }
             release(&TempProc->lock);
         }
+        else
+        {
+            release(&ptable.lock);
+            kzrefill(); // nothing to run: zero a page
+        }
     }
 #endif
 
@@ -722,25 +1205,39 @@ void scheduler(void)
         // Avoid deadlock by ensuring that devices can interrupt.
         intr_on();
 
-        for (p = proc; p < &proc[NPROC]; p++)
+        acquire(&ptable.lock);
+        for (p = ptable.allproc; p != 0; p = p->allnext)
         {
             acquire(&p->lock);
             if (p->state == RUNNABLE)
-            {
-                // Switch to chosen process.  It is the process's job
-                // to release its lock and then reacquire it
-                // before jumping back to us.
-                p->state = RUNNING;
-                c->proc = p;
-                p->wtime1 += (ticks - p->runnable_time);
-                swtch(&c->context, &p->context);
-
-                // Process is done running for now.
-                // It should have changed its p->state before coming back.
-                c->proc = 0;
-            }
+                break;
             release(&p->lock);
         }
+        if (p == 0)
+        {
+            release(&ptable.lock);
+            kzrefill(); // nothing to run: zero a page
+            continue;
+        }
+        // Send p to the back of the line, so the others
+        // get a turn before it runs again.
+        unlinkproc(p);
+        linkproc(p);
+        release(&ptable.lock);
+
+        // Switch to chosen process.  It is the process's job
+        // to release its lock and then reacquire it
+        // before jumping back to us.
+        p->state = RUNNING;
+        c->proc = p;
+        p->wtime1 += (ticks - p->runnable_time);
+        schedtrace_log(SCHED_EV_SWITCH_IN, p, 0);
+        runproc(c, p);
+
+        // Process is done running for now.
+        // It should have changed its p->state before coming back.
+        c->proc = 0;
+        release(&p->lock);
     }
 #endif
 
@@ -749,7 +1246,8 @@ void scheduler(void)
     {
         intr_on();
         struct proc *TempProc = 0;
-        for (p = proc; p < &proc[NPROC]; p++)
+        acquire(&ptable.lock);
+        for (p = ptable.allproc; p != 0; p = p->allnext)
         {
             if (p->rtime == 0 && p->time_stopped == 0)
                 p->niceness = 0;
@@ -787,17 +1285,24 @@ void scheduler(void)
         if (TempProc)
         {
             acquire(&TempProc->lock);
+            release(&ptable.lock);
             if (TempProc->state == RUNNABLE)
             {
                 TempProc->state = RUNNING;
                 TempProc->times_chosen++;
                 c->proc = TempProc;
-                p->wtime1 += (ticks - p->runnable_time);
-                swtch(&c->context, &TempProc->context);
+                TempProc->wtime1 += (ticks - TempProc->runnable_time);
+                schedtrace_log(SCHED_EV_SWITCH_IN, TempProc, TempProc->dynamic_priority);
+                runproc(c, TempProc);
                 c->proc = 0;
             }
             release(&TempProc->lock);
         }
+        else
+        {
+            release(&ptable.lock);
+            kzrefill(); // nothing to run: zero a page
+        }
     }
 #endif
 
@@ -805,7 +1310,8 @@ void scheduler(void)
     for (;;)
     {
         intr_on();
-        for (p = proc; p < &proc[NPROC]; p++)
+        acquire(&ptable.lock);
+        for (p = ptable.allproc; p != 0; p = p->allnext)
         {
             acquire(&p->lock);
             if (p->state == RUNNABLE)
@@ -813,6 +1319,7 @@ void scheduler(void)
                 if (!(p->in_queue))
                 {
                     push(&mlfq[p->queue_stage], p);
+                    p->in_queue = 1;
                 }
             }
             release(&p->lock);
@@ -821,19 +1328,25 @@ void scheduler(void)
         struct proc *schedule_this = MLFQ_Schedule();
         if (schedule_this)
         {
-            //printf("Queue 0 size: %d %d %d %s\n", mlfq[0].sz, mlfq[0].head, mlfq[0].tail, schedule_this->name);
             acquire(&schedule_this->lock);
+            release(&ptable.lock);
             if (schedule_this->state == RUNNABLE)
             {
                 schedule_this->times_chosen++;
                 schedule_this->state = RUNNING;
                 c->proc = schedule_this;
-                p->wtime1 += (ticks - p->runnable_time);
-                swtch(&c->context, &schedule_this->context);
+                schedule_this->wtime1 += (ticks - schedule_this->runnable_time);
+                schedtrace_log(SCHED_EV_SWITCH_IN, schedule_this, schedule_this->queue_stage);
+                runproc(c, schedule_this);
                 c->proc = 0;
             }
             release(&schedule_this->lock);
         }
+        else
+        {
+            release(&ptable.lock);
+            kzrefill(); // nothing to run: zero a page
+        }
     }
 #endif
 }
@@ -859,6 +1372,8 @@ void sched(void)
     if (intr_get())
         panic("sched interruptible");
 
+    schedtrace_log(SCHED_EV_SWITCH_OUT, p, p->state);
+    mycpu()->resched = 0;
     intena = mycpu()->intena;
     swtch(&p->context, &mycpu()->context);
     mycpu()->intena = intena;
@@ -871,10 +1386,54 @@ void yield(void)
     acquire(&p->lock);
     p->state = RUNNABLE;
     p->runnable_time = ticks;
+    schedtrace_log(SCHED_EV_PREEMPT, p, p->queue_stage);
     sched();
     release(&p->lock);
 }
 
+// Kernel preemption. Each CPU's preempt count is its push_off()
+// depth, noff: holding a spinlock, or having interrupts pushed
+// off, keeps a process from giving up the CPU in the kernel.
+// A timer tick can only arrive when the count is zero, and
+// kerneltrap() then calls kpreempt(), which yields at once.
+// With make KCOOP=1 the kernel is cooperative instead:
+// kpreempt() only sets resched, and the process gives up the
+// CPU at the next preempt_point(), in the long loops of
+// uvmcopy(), itrunc() and writei(), or on the way back to user
+// space. That mode is less preemptible than the default; it
+// is there to measure how far the preemption points alone
+// bound scheduling latency.
+
+// Called by kerneltrap() on a timer tick that should preempt
+// the current process. Interrupts are off.
+void kpreempt(void)
+{
+#ifdef KCOOP
+    mycpu()->resched = 1;
+#else
+    yield();
+#endif
+}
+
+// Give up the CPU if a timer tick asked for it and it is safe
+// to: the preempt count is zero.
+void preempt_point(void)
+{
+    struct cpu *c;
+    struct proc *p;
+    int resched;
+
+    push_off();
+    c = mycpu();
+    p = c->proc;
+    // one for the push_off() above.
+    resched = c->resched && c->noff == 1;
+    pop_off();
+
+    if (resched && p != 0 && p->state == RUNNING)
+        yield();
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch to forkret.
 void forkret(void)
@@ -931,12 +1490,13 @@ void sleep(void *chan, struct spinlock *lk)
 }
 
 // Wake up all processes sleeping on chan.
-// Must be called without any p->lock.
+// Must be called without any p->lock or ptable.lock.
 void wakeup(void *chan)
 {
     struct proc *p;
 
-    for (p = proc; p < &proc[NPROC]; p++)
+    acquire(&ptable.lock);
+    for (p = ptable.allproc; p != 0; p = p->allnext)
     {
         if (p != myproc())
         {
@@ -946,10 +1506,12 @@ void wakeup(void *chan)
                 p->state = RUNNABLE;
                 p->runnable_time = ticks;
                 p->time_stopped += ticks - p->time_stopped_temp;
+                schedtrace_log(SCHED_EV_WAKEUP, p, 0);
             }
             release(&p->lock);
         }
     }
+    release(&ptable.lock);
 }
 
 // Kill the process with the given pid.
@@ -959,23 +1521,17 @@ int kill(int pid)
 {
     struct proc *p;
 
-    for (p = proc; p < &proc[NPROC]; p++)
+    if ((p = findproc(pid)) == 0)
+        return -1;
+    p->killed = 1;
+    if (p->state == SLEEPING)
     {
-        acquire(&p->lock);
-        if (p->pid == pid)
-        {
-            p->killed = 1;
-            if (p->state == SLEEPING)
-            {
-                // Wake process from sleep().
-                p->state = RUNNABLE;
-            }
-            release(&p->lock);
-            return 0;
-        }
-        release(&p->lock);
+        // Wake process from sleep().
+        p->state = RUNNABLE;
+        schedtrace_log(SCHED_EV_WAKEUP, p, 0);
     }
-    return -1;
+    release(&p->lock);
+    return 0;
 }
 
 // Copy to either a user address, or kernel address,
@@ -1014,7 +1570,8 @@ int either_copyin(void *dst, int user_src, uint64 src, uint64 len)
 
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
-// No lock to avoid wedging a stuck machine further.
+// Holds ptable.lock, since descriptors are freed as
+// processes are reaped, but takes no p->lock.
 void procdump(void)
 {
     static char *states[] = {
@@ -1039,7 +1596,8 @@ void procdump(void)
 #ifdef PBS
     printf("PID \t Priority \t State \t\t rtime \t wtime \t nrun\n");
 #endif
-    for (p = proc; p < &proc[NPROC]; p++)
+    acquire(&ptable.lock);
+    for (p = ptable.allproc; p != 0; p = p->allnext)
     {
         if (p->state == UNUSED)
             continue;
@@ -1062,4 +1620,5 @@ void procdump(void)
 
     printf("\n");
     }
+    release(&ptable.lock);
 }
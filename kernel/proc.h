@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int resched;                // A timer tick asked for a reschedule.
+  uint kstackgen;             // kstackgen as of this CPU's last TLB flush.
+  uint64 asidgen;             // ASID generation as of its last full flush.
 };
 
 extern struct cpu cpus[NCPU];
@@ -82,6 +85,20 @@ struct trapframe {
 
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A range of user memory [start, end) whose pages are read
+// from ip on first touch, starting at file offset off; bytes
+// past filesz are zero, and ip is 0 for anonymous memory.
+// exec() makes one per ELF segment, and mmap() one per mapping.
+struct vma {
+  uint64 start;                // page-aligned
+  uint64 end;
+  struct inode *ip;
+  uint off;
+  uint filesz;
+  int perm;                    // PTE_R, PTE_W, PTE_X, PTE_U
+  int flags;                   // MAP_SHARED or MAP_PRIVATE; 0 if this slot is free
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -93,8 +110,15 @@ struct proc {
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
 
-  // wait_lock must be held when using this:
+  // pid_lock must be held when using this:
+  struct proc *pidnext;        // Next in pidhash chain
+
+  // wait_lock must be held when using these:
   struct proc *parent;         // Parent process
+  struct proc *children;       // Live children
+  struct proc *zombies;        // Exited children not yet waited for
+  struct proc *sibnext;        // Next on parent's children or zombies
+  struct proc *sibprev;        // Previous on that list
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -104,6 +128,14 @@ struct proc {
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vmas[NVMA];       // Demand-paged ranges; see vmfault()
+  int insyscall;               // In a system call; procmem() reads it when p isn't running
+  uint64 pinstart, pinend;     // User pages swapout() must leave; see uvmpin()
+  int ucopy;                   // In a direct user copy; see ufault()
+  int ufail;                   // That copy hit a page it couldn't have
+  uint asid;                   // Tags pagetable's TLB entries; see uvmsatp()
+  uint64 asidgen;              // Generation of asid, or 0 if none yet
+  uint tlbstale;               // CPUs that must flush asid before running p
   char name[16];               // Process name (debugging)
 
   uint rtime;                   // How long the process ran for
@@ -127,11 +159,17 @@ struct proc {
   uint level_enter;
 
   int level_times[NMLFQ];
+  int last_cpu;                 // CPU it last ran on, for schedtrace
+
+  // ptable.lock must be held when using these:
+  struct proc *allnext;         // Next on ptable.allproc
+  struct proc *allprev;         // Previous on ptable.allproc
+  struct proc *qnext;           // Next in its MLFQ queue
+  int kslot;                    // Kernel stack slot, for KSTACK()
 };
 
 struct Queue{
-    int head, tail;
-    struct proc* qarr[NPROC+5];
+    struct proc *head, *tail;
     int sz;
 };
 
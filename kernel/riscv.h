@@ -40,6 +40,7 @@ w_mepc(uint64 x)
 
 // Supervisor Status Register, sstatus
 
+#define SSTATUS_SUM (1L << 18) // Supervisor may access User pages
 #define SSTATUS_SPP (1L << 8)  // Previous mode, 1=Supervisor, 0=User
 #define SSTATUS_SPIE (1L << 5) // Supervisor Previous Interrupt Enable
 #define SSTATUS_UPIE (1L << 4) // User Previous Interrupt Enable
@@ -198,6 +199,11 @@ w_pmpaddr0(uint64 x)
 
 #define MAKE_SATP(pagetable) (SATP_SV39 | (((uint64)pagetable) >> 12))
 
+// the address-space ID that tags TLB entries.
+#define SATP_ASID_SHIFT 44
+#define SATP_ASID_MASK (0xffffL << SATP_ASID_SHIFT)
+#define MAKE_SATP_ASID(pagetable, asid) (MAKE_SATP(pagetable) | ((uint64)(asid) << SATP_ASID_SHIFT))
+
 // supervisor address translation and protection;
 // holds the address of the page table.
 static inline void 
@@ -331,6 +337,20 @@ sfence_vma()
   asm volatile("sfence.vma zero, zero");
 }
 
+// flush the TLB entries for va tagged with asid.
+static inline void
+sfence_vma_page(uint64 va, uint64 asid)
+{
+  asm volatile("sfence.vma %0, %1" : : "r" (va), "r" (asid));
+}
+
+// flush all the TLB entries tagged with asid.
+static inline void
+sfence_vma_asid(uint64 asid)
+{
+  asm volatile("sfence.vma zero, %0" : : "r" (asid));
+}
+
 
 #define PGSIZE 4096 // bytes per page
 #define PGSHIFT 12  // bits of offset within a page
@@ -338,11 +358,24 @@ sfence_vma()
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+// a level-1 leaf PTE maps a 2 MiB "megapage".
+#define MEGAPGSIZE (512*PGSIZE)
+#define MEGAORDER 9  // kalloc_pages() order of a megapage
+#define MEGAROUNDDOWN(a) (((a)) & ~(MEGAPGSIZE-1))
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
+#define PTE_A (1L << 6) // accessed
+#define PTE_D (1L << 7) // dirty: set by the MMU on a store
+#define PTE_COW (1L << 8) // software bit: copy-on-write page
+#define PTE_SWAP (1L << 9) // software bit: swapped out, PTE_V clear
+
+// a valid PTE is a leaf if any of R, W, X is set,
+// and otherwise points to the next level's page table.
+#define PTE_LEAF(pte) (((pte) & PTE_V) && ((pte) & (PTE_R|PTE_W|PTE_X)))
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -351,6 +384,10 @@ sfence_vma()
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// a PTE_SWAP PTE holds a swap slot where the PPN would be.
+#define SLOT2PTE(slot) (((uint64)(slot)) << 10)
+#define PTE2SLOT(pte) ((pte) >> 10)
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
@@ -0,0 +1,143 @@
+// Per-CPU scheduler event trace.
+//
+// Each CPU appends to its own ring with interrupts off, so
+// logging takes no lock: the only writer of a ring is the CPU
+// that owns it. head counts every event ever logged, and a slot
+// is published by bumping head after the record is written.
+//
+// schedtrace_read() is the only reader. It keeps a tail per ring
+// under stlock, and re-checks head after copying a record, since
+// the owning CPU may have lapped the reader and be overwriting
+// that slot. Overwritten records are reported as SCHED_EV_LOST.
+//
+// Only built with make SCHEDTRACE=1; otherwise schedtrace_log()
+// is an empty macro (see defs.h) and costs nothing.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "defs.h"
+#include "schedtrace.h"
+
+#ifdef SCHEDTRACE
+
+struct schedring {
+  struct schedevent ev[NSCHEDTRACE];
+  uint64 head;   // written only by the owning CPU
+  uint64 tail;   // next record to read; stlock
+  uint64 lost;   // dropped records not yet reported; stlock
+};
+
+static struct schedring rings[NCPU];
+static struct spinlock stlock;
+
+void
+schedtraceinit(void)
+{
+  initlock(&stlock, "schedtrace");
+}
+
+// Append one record to r. Interrupts must be off,
+// and r must belong to this CPU.
+static void
+record(struct schedring *r, int type, int pid, int cpu, int arg)
+{
+  struct schedevent *e;
+
+  e = &r->ev[r->head % NSCHEDTRACE];
+  e->ts = r_time();
+  e->pid = pid;
+  e->cpu = cpu;
+  e->type = type;
+  e->arg = arg;
+
+  // make the record visible before the new head.
+  __sync_synchronize();
+  r->head++;
+}
+
+// Log a scheduler event about p on this CPU.
+void
+schedtrace_log(int type, struct proc *p, int arg)
+{
+  int id;
+  struct schedring *r;
+
+  push_off();
+  id = cpuid();
+  r = &rings[id];
+  if(type == SCHED_EV_SWITCH_IN){
+    if(p->last_cpu >= 0 && p->last_cpu != id)
+      record(r, SCHED_EV_MIGRATE, p->pid, id, p->last_cpu);
+    p->last_cpu = id;
+  }
+  record(r, type, p->pid, id, arg);
+  pop_off();
+}
+
+// Drain up to n events into the user array at addr,
+// oldest first within each CPU.
+// Returns the number of events copied, or -1 on error.
+int
+schedtrace_read(uint64 addr, int n)
+{
+  struct schedevent buf[16], e;
+  struct schedring *r;
+  uint64 head;
+  int i, k, got;
+
+  got = 0;
+  for(i = 0; i < NCPU && got < n; i++){
+    r = &rings[i];
+    for(;;){
+      acquire(&stlock);
+      // an event after lost ones needs room for a SCHED_EV_LOST
+      // record ahead of it; with room for just one, the record
+      // goes now and the event waits for the next read.
+      for(k = 0; k < NELEM(buf) - 1 && got + k < n; ){
+        head = r->head;
+        __sync_synchronize();
+        if(r->tail == head)
+          break;
+        if(head - r->tail > NSCHEDTRACE){
+          r->lost += head - NSCHEDTRACE - r->tail;
+          r->tail = head - NSCHEDTRACE;
+        }
+        e = r->ev[r->tail % NSCHEDTRACE];
+        __sync_synchronize();
+        if(r->head - r->tail >= NSCHEDTRACE){
+          // the owner may have rewritten this slot while we copied it.
+          r->lost++;
+          r->tail++;
+          continue;
+        }
+        if(r->lost){
+          buf[k].ts = e.ts;
+          buf[k].pid = 0;
+          buf[k].cpu = i;
+          buf[k].type = SCHED_EV_LOST;
+          buf[k].arg = r->lost;
+          r->lost = 0;
+          k++;
+          if(got + k == n)
+            break;
+        }
+        r->tail++;
+        buf[k++] = e;
+      }
+      release(&stlock);
+
+      if(k == 0)
+        break;
+      if(copyout(myproc()->pagetable, addr + got*sizeof(e), (char*)buf, k*sizeof(e)) < 0)
+        return -1;
+      got += k;
+    }
+  }
+  return got;
+}
+
+#endif
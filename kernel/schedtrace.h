@@ -0,0 +1,20 @@
+// Scheduler event trace records, drained by the schedtrace()
+// system call. Shared with user space (user/schedtrace.c).
+
+#define SCHED_EV_SWITCH_IN   1  // scheduler swtch()ed to the process
+#define SCHED_EV_SWITCH_OUT  2  // process gave up the CPU; arg = new state
+#define SCHED_EV_WAKEUP      3  // SLEEPING -> RUNNABLE
+#define SCHED_EV_MIGRATE     4  // runs on a different CPU than last time; arg = old cpu
+#define SCHED_EV_DEMOTE      5  // MLFQ: moved down a queue; arg = new queue
+#define SCHED_EV_AGE         6  // MLFQ: moved up a queue by ageing; arg = new queue
+#define SCHED_EV_PREEMPT     7  // timer interrupt forced a yield()
+#define SCHED_EV_LOST        8  // ring overflowed; arg = number of events dropped
+
+struct schedevent {
+  uint64 ts;     // time CSR when the event was logged
+  int pid;
+  ushort cpu;
+  uchar type;    // SCHED_EV_*
+  uchar pad;
+  int arg;
+};
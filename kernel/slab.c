@@ -0,0 +1,250 @@
+// Object caches for kernel structures smaller than a page.
+//
+// Each cache keeps a list of slabs, one page each, that still
+// have free objects. A slab starts with a struct slab header,
+// followed by as many objects as fit. Freed objects go back on
+// their slab's free list, and a slab whose objects are all free
+// is given back to kalloc() at once.
+//
+// In front of the slabs, each CPU has a magazine of up to
+// MAGSIZE free objects, so that most allocations and frees
+// touch only this CPU's magazine. An empty magazine is filled
+// with MAGSIZE/2 objects from the slabs, and a full one gives
+// MAGSIZE/2 back. When kalloc() runs out of memory, it calls
+// kmem_cache_reclaim() to empty every magazine, which frees the
+// slabs that only magazines were holding on to.
+//
+// No lock is held while calling kalloc(), since it may reclaim.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "slab.h"
+
+struct run {
+  struct run *next;
+};
+
+struct slab {
+  struct slab *next;    // on cache->partial
+  struct slab *prev;
+  struct run *free;     // free objects in this slab
+  int inuse;            // objects handed out
+};
+
+// every cache, for kmem_cache_reclaim(). Caches are
+// only made at boot, so the list needs no lock.
+static struct kmem_cache *caches;
+
+void
+kmem_cache_init(struct kmem_cache *c, char *name, uint size)
+{
+  initlock(&c->lock, name);
+  for(int i = 0; i < NCPU; i++){
+    initlock(&c->mag[i].lock, name);
+    c->mag[i].n = 0;
+  }
+  c->name = name;
+  c->size = (size + 7) & ~7;
+  c->partial = 0;
+  if(c->size + sizeof(struct slab) > PGSIZE)
+    panic("kmem_cache_init: object too big");
+  c->next = caches;
+  caches = c;
+}
+
+static void
+slabunlink(struct kmem_cache *c, struct slab *s)
+{
+  if(s->prev)
+    s->prev->next = s->next;
+  else
+    c->partial = s->next;
+  if(s->next)
+    s->next->prev = s->prev;
+  s->next = s->prev = 0;
+}
+
+static void
+slabpush(struct kmem_cache *c, struct slab *s)
+{
+  s->prev = 0;
+  s->next = c->partial;
+  if(c->partial)
+    c->partial->prev = s;
+  c->partial = s;
+}
+
+// Return a fresh slab with all its objects free, or 0.
+static struct slab*
+newslab(struct kmem_cache *c)
+{
+  struct slab *s;
+  char *o;
+
+  if((s = (struct slab*)kalloc()) == 0)
+    return 0;
+  s->next = s->prev = 0;
+  s->free = 0;
+  s->inuse = 0;
+  for(o = (char*)s + PGSIZE - c->size;
+      o >= (char*)(s + 1); o -= c->size){
+    ((struct run*)o)->next = s->free;
+    s->free = (struct run*)o;
+  }
+  return s;
+}
+
+// Take up to n objects from c's slabs into objs, making a
+// new slab if there are none. Returns how many, 0 if out
+// of memory.
+static int
+slabtake(struct kmem_cache *c, void **objs, int n)
+{
+  struct slab *s;
+  struct run *r;
+  int k;
+
+  acquire(&c->lock);
+  for(k = 0; k < n; ){
+    if((s = c->partial) == 0){
+      if(k > 0)
+        break;
+      release(&c->lock);
+      if((s = newslab(c)) == 0)
+        return 0;
+      acquire(&c->lock);
+      slabpush(c, s);
+    }
+    r = s->free;
+    s->free = r->next;
+    s->inuse++;
+    if(s->free == 0)
+      slabunlink(c, s);
+    objs[k++] = r;
+  }
+  release(&c->lock);
+  return k;
+}
+
+// Put n objects back on their slabs, and free the slabs
+// that end up empty. Returns the number of slabs freed.
+static int
+slabput(struct kmem_cache *c, void **objs, int n)
+{
+  struct slab *s, *empty;
+  struct run *r;
+  int k, nfreed;
+
+  empty = 0;
+  acquire(&c->lock);
+  for(k = 0; k < n; k++){
+    s = (struct slab*)PGROUNDDOWN((uint64)objs[k]);
+    r = (struct run*)objs[k];
+    if(s->inuse < 1)
+      panic("kmem_cache_free");
+    if(s->free == 0)
+      slabpush(c, s);
+    r->next = s->free;
+    s->free = r;
+    if(--s->inuse == 0){
+      slabunlink(c, s);
+      s->next = empty;
+      empty = s;
+    }
+  }
+  release(&c->lock);
+
+  for(nfreed = 0; (s = empty) != 0; nfreed++){
+    empty = s->next;
+    kfree(s);
+  }
+  return nfreed;
+}
+
+// Allocate one object from c. Its contents are garbage.
+// Returns 0 if out of memory.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct magazine *m;
+  void *objs[MAGSIZE/2], *o;
+  int n;
+
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  o = m->n > 0 ? m->obj[--m->n] : 0;
+  release(&m->lock);
+  pop_off();
+  if(o)
+    return o;
+
+  // refill this CPU's magazine, keeping one object.
+  if((n = slabtake(c, objs, MAGSIZE/2)) == 0)
+    return 0;
+  o = objs[--n];
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  while(n > 0 && m->n < MAGSIZE)
+    m->obj[m->n++] = objs[--n];
+  release(&m->lock);
+  pop_off();
+  if(n > 0)
+    slabput(c, objs, n);
+  return o;
+}
+
+// Give an object back to the cache it came from.
+void
+kmem_cache_free(struct kmem_cache *c, void *o)
+{
+  struct magazine *m;
+  void *objs[MAGSIZE/2];
+  int n;
+
+  n = 0;
+  push_off();
+  m = &c->mag[cpuid()];
+  acquire(&m->lock);
+  if(m->n == MAGSIZE){
+    // full: give half back to the slabs.
+    n = MAGSIZE/2;
+    m->n -= n;
+    memmove(objs, &m->obj[m->n], n * sizeof(void*));
+  }
+  m->obj[m->n++] = o;
+  release(&m->lock);
+  pop_off();
+  if(n > 0)
+    slabput(c, objs, n);
+}
+
+// Empty every CPU's magazine in every cache, for kalloc()
+// when memory runs out. Returns the number of pages freed.
+int
+kmem_cache_reclaim(void)
+{
+  struct kmem_cache *c;
+  struct magazine *m;
+  void *objs[MAGSIZE];
+  int i, n, nfreed;
+
+  nfreed = 0;
+  for(c = caches; c; c = c->next){
+    for(i = 0; i < NCPU; i++){
+      m = &c->mag[i];
+      acquire(&m->lock);
+      n = m->n;
+      memmove(objs, m->obj, n * sizeof(void*));
+      m->n = 0;
+      release(&m->lock);
+      nfreed += slabput(c, objs, n);
+    }
+  }
+  return nfreed;
+}
@@ -0,0 +1,19 @@
+#define MAGSIZE 16  // objects in a per-CPU magazine
+
+// A CPU's stack of free objects, in front of the slabs.
+struct magazine {
+  struct spinlock lock;
+  int n;                // objects in obj[]
+  void *obj[MAGSIZE];
+};
+
+// Object cache: hands out fixed-size kernel objects
+// carved from whole pages obtained from kalloc().
+struct kmem_cache {
+  struct spinlock lock;
+  char *name;           // For debugging.
+  uint size;            // Object size, a multiple of 8.
+  struct slab *partial; // Slabs with at least one free object.
+  struct magazine mag[NCPU];
+  struct kmem_cache *next; // In the list of all caches.
+};
@@ -16,10 +16,14 @@ uint64 timer_scratch[NCPU][5];
 // assembly code in kernelvec.S for machine-mode timer interrupt.
 extern void timervec();
 
-// entry.S jumps here in machine mode on stack0.
+// entry.S jumps here in machine mode on stack0, with the
+// devicetree's physical address from qemu.
 void
-start()
+start(uint64 fdt)
 {
+  // for bootparam() in fdt.c.
+  dtb = fdt;
+
   // set M Previous Privilege mode to Supervisor, for mret.
   unsigned long x = r_mstatus();
   x &= ~MSTATUS_MPP_MASK;
@@ -43,6 +47,9 @@ start()
   w_pmpaddr0(0x3fffffffffffffull);
   w_pmpcfg0(0xf);
 
+  // let supervisor mode read the time CSR (for schedtrace timestamps).
+  w_mcounteren(r_mcounteren() | 2);
+
   // ask for clock interrupts.
   timerinit();
 
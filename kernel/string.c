@@ -38,14 +38,35 @@ memmove(void *dst, const void *src, uint n)
   
   s = src;
   d = dst;
+  // when s and d are aligned alike, move the bytes up to
+  // a word boundary, then whole words, then the rest.
   if(s < d && s + n > d){
     s += n;
     d += n;
+    if(((uint64)s ^ (uint64)d) % 8 == 0){
+      for(; n > 0 && (uint64)d % 8 != 0; n--)
+        *--d = *--s;
+      for(; n >= 8; n -= 8){
+        d -= 8;
+        s -= 8;
+        *(uint64*)d = *(const uint64*)s;
+      }
+    }
     while(n-- > 0)
       *--d = *--s;
-  } else
+  } else {
+    if(((uint64)s ^ (uint64)d) % 8 == 0){
+      for(; n > 0 && (uint64)d % 8 != 0; n--)
+        *d++ = *s++;
+      for(; n >= 8; n -= 8){
+        *(uint64*)d = *(const uint64*)s;
+        d += 8;
+        s += 8;
+      }
+    }
     while(n-- > 0)
       *d++ = *s++;
+  }
 
   return dst;
 }
@@ -0,0 +1,277 @@
+// Swapping user pages out to disk when memory runs out.
+//
+// The swap area is NSWAP pages of the disk, right after the
+// file system's FSSIZE blocks; the Makefile makes fs.img big
+// enough. A swapped-out page's PTE has PTE_V clear and
+// PTE_SWAP set, and holds the swap slot where the PPN would be,
+// along with the page's R, W, X and U bits. Touching the page
+// faults, and vmfault() calls swapin() to read it back.
+//
+// kalloc() calls swapout() when nothing else frees memory. It
+// picks a victim with the clock (second-chance) algorithm: a
+// hand goes round the user pages of all processes, in pid
+// order, clearing PTE_A on each page used since the hand last
+// passed, and takes the first page whose PTE_A is already clear.
+//
+// Only pages that can be taken behind a process's back are
+// candidates: whole 4096-byte pages that nothing else maps
+// (not copy-on-write, not in the program page cache, not in a
+// MAP_SHARED mapping), of a process that is not running on
+// another CPU, and outside the range it has pinned (see
+// uvmpin()): the pages a copy is using, and those faulted in
+// to copy under a spinlock.
+// tlbflush() sees to TLB entries for the page that CPUs which
+// ran the process before may still hold.
+//
+// One sleep-lock serializes swap I/O, so a page being written
+// out can't be read back in before the write is done.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "fcntl.h"
+#include "proc.h"
+#include "defs.h"
+
+#define SWAPSTART FSSIZE  // first block of the swap area
+
+struct {
+  struct spinlock lock;     // protects used[]
+  char used[NSWAP];         // is each slot in use?
+
+  struct sleeplock io;      // protects everything below
+  int pid;                  // the clock hand: process
+  uint64 va;                // and page it is at
+  struct buf buf;           // for virtio_disk_rw()
+} swap;
+
+void
+swapinit(void)
+{
+  initlock(&swap.lock, "swap");
+  initsleeplock(&swap.io, "swap io");
+}
+
+// Take a free swap slot. Returns -1 if swap is full.
+static int
+slotalloc(void)
+{
+  int i;
+
+  acquire(&swap.lock);
+  for(i = 0; i < NSWAP; i++){
+    if(!swap.used[i]){
+      swap.used[i] = 1;
+      release(&swap.lock);
+      return i;
+    }
+  }
+  release(&swap.lock);
+  return -1;
+}
+
+// How many swap slots are in use.
+int
+swapcount(void)
+{
+  int i, n;
+
+  n = 0;
+  acquire(&swap.lock);
+  for(i = 0; i < NSWAP; i++)
+    n += swap.used[i];
+  release(&swap.lock);
+  return n;
+}
+
+// Give back the swap slot of a swapped-out page that is
+// being unmapped, or has been read back in.
+void
+swapfree(uint slot)
+{
+  if(slot >= NSWAP)
+    panic("swapfree");
+  acquire(&swap.lock);
+  if(!swap.used[slot])
+    panic("swapfree: free slot");
+  swap.used[slot] = 0;
+  release(&swap.lock);
+}
+
+// Read or write the page at pa from or to a swap slot, a
+// block at a time. Caller holds swap.io.
+static void
+swaprw(uint slot, char *pa, int write)
+{
+  int i;
+
+  for(i = 0; i < PGSIZE / BSIZE; i++){
+    swap.buf.blockno = SWAPSTART + slot * (PGSIZE / BSIZE) + i;
+    if(write)
+      memmove(swap.buf.data, pa + i * BSIZE, BSIZE);
+    virtio_disk_rw(&swap.buf, write);
+    if(!write)
+      memmove(pa + i * BSIZE, swap.buf.data, BSIZE);
+  }
+}
+
+// May p's pages be swapped out now? Caller holds p->lock.
+static int
+evictable(struct proc *p)
+{
+  // in kalloc() on this CPU.
+  if(p == myproc())
+    return 1;
+  return p->state == RUNNABLE || p->state == SLEEPING;
+}
+
+// Could the page at va, with PTE pte, be swapped out?
+static int
+candidate(struct proc *p, uint64 va, pte_t pte)
+{
+  struct vma *v;
+
+  if((pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U))
+    return 0;
+  if(va >= p->pinstart && va < p->pinend)
+    return 0;
+  if(krefcount((void*)PTE2PA(pte)) != 1)
+    return 0;
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if((v->flags & MAP_SHARED) && va >= v->start && va < v->end)
+      return 0;
+  return 1;
+}
+
+// Move the clock hand over p's pages from *va on, giving
+// each candidate with PTE_A set a second chance. Returns the
+// PTE of the first one without, and sets *va to its address,
+// or returns 0 at the end of p's address space. Megapages are
+// skipped. Caller holds p->lock.
+static pte_t*
+scan(struct proc *p, uint64 *va)
+{
+  pte_t *pte;
+  uint64 a;
+
+  for(a = *va; a < MAXVA; ){
+    pte = &p->pagetable[PX(2, a)];
+    if((*pte & PTE_V) == 0){
+      a = (PX(2, a) + 1L) << PXSHIFT(2);
+      continue;
+    }
+#ifdef SHAREDPT
+    // the kernel's mappings; see kvmshare().
+    if(PX(2, a) == PX(2, KERNBASE)){
+      a = KERNTOP;
+      continue;
+    }
+#endif
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(1, a)];
+    if((*pte & PTE_V) == 0 || PTE_LEAF(*pte)){
+      a = MEGAROUNDDOWN(a) + MEGAPGSIZE;
+      continue;
+    }
+    pte = &((pagetable_t)PTE2PA(*pte))[PX(0, a)];
+    if(candidate(p, a, *pte)){
+      if((*pte & PTE_A) == 0){
+        *va = a;
+        return pte;
+      }
+      *pte &= ~PTE_A;
+    }
+    a += PGSIZE;
+  }
+  return 0;
+}
+
+// Write one user page out to swap and free it. Returns the
+// number of pages freed: 0 if there is no page to take, or
+// swap is full, or the caller holds a spinlock, since writing
+// to the disk sleeps.
+int
+swapout(void)
+{
+  struct proc *p;
+  pte_t *pte;
+  uint64 pa;
+  int slot, noff, wraps;
+
+  push_off();
+  noff = mycpu()->noff;
+  pop_off();
+  if(myproc() == 0 || noff > 1)
+    return 0;
+
+  acquiresleep(&swap.io);
+  if((slot = slotalloc()) < 0){
+    releasesleep(&swap.io);
+    return 0;
+  }
+
+  // starting part-way round, the hand may have to finish
+  // this round and go round once more clearing PTE_A
+  // before it finds a victim.
+  pa = 0;
+  for(wraps = 0; pa == 0 && wraps < 3; ){
+    if((p = procfrom(swap.pid)) == 0){
+      swap.pid = 0;
+      swap.va = 0;
+      wraps++;
+      continue;
+    }
+    if(p->pid != swap.pid){
+      swap.pid = p->pid;
+      swap.va = 0;
+    }
+    if(evictable(p) && (pte = scan(p, &swap.va)) != 0){
+      pa = PTE2PA(*pte);
+      *pte = SLOT2PTE(slot) | PTE_SWAP | (*pte & (PTE_R|PTE_W|PTE_X|PTE_U));
+      tlbflush(p, swap.va);
+      swap.va += PGSIZE;
+    } else {
+      swap.pid = p->pid + 1;
+      swap.va = 0;
+    }
+    release(&p->lock);
+  }
+  if(pa == 0){
+    swapfree(slot);
+    releasesleep(&swap.io);
+    return 0;
+  }
+
+  swaprw(slot, (char*)pa, 1);
+  releasesleep(&swap.io);
+  kfree((void*)pa);
+  return 1;
+}
+
+// Read the swapped-out page at va back in and map it.
+// Returns its physical address, or 0 if out of memory.
+uint64
+swapin(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  char *mem;
+  uint slot;
+
+  // before taking swap.io, since kalloc() may swap out.
+  if((mem = kalloc()) == 0)
+    return 0;
+  acquiresleep(&swap.io);
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_SWAP) == 0)
+    panic("swapin");
+  slot = PTE2SLOT(*pte);
+  swaprw(slot, mem, 0);
+  *pte = PA2PTE(mem) | (PTE_FLAGS(*pte) & ~PTE_SWAP) | PTE_V | PTE_A;
+  releasesleep(&swap.io);
+  swapfree(slot);
+  return (uint64)mem;
+}
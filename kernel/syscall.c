@@ -8,12 +8,12 @@
 #include "defs.h"
 
 // Fetch the uint64 at addr from the current process.
+// copyin() checks that it is user memory, which the stack,
+// above p->sz, is too.
 int
 fetchaddr(uint64 addr, uint64 *ip)
 {
   struct proc *p = myproc();
-  if(addr >= p->sz || addr+sizeof(uint64) > p->sz)
-    return -1;
   if(copyin(p->pagetable, (char *)ip, addr, sizeof(*ip)) != 0)
     return -1;
   return 0;
@@ -107,6 +107,12 @@ extern uint64 sys_write(void);
 extern uint64 sys_uptime(void);
 extern uint64 sys_trace(void);
 extern uint64 sys_setpriority(void);
+extern uint64 sys_schedtrace(void);
+extern uint64 sys_mmap(void);
+extern uint64 sys_munmap(void);
+extern uint64 sys_memstat(void);
+extern uint64 sys_procmem(void);
+extern uint64 sys_spawn(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -132,23 +138,33 @@ static uint64 (*syscalls[])(void) = {
 [SYS_close]   sys_close,
 [SYS_waitx]   sys_waitx,
 [SYS_trace]   sys_trace,
-[SYS_setpriority] sys_setpriority
+[SYS_setpriority] sys_setpriority,
+[SYS_schedtrace] sys_schedtrace,
+[SYS_mmap]    sys_mmap,
+[SYS_munmap]  sys_munmap,
+[SYS_memstat] sys_memstat,
+[SYS_procmem] sys_procmem,
+[SYS_spawn]   sys_spawn,
 };
 
-static char *syscall_list[25] = {
+static char *syscall_list[] = {
   "-",      "fork",     "exit",     "wait",         "pipe",  
   "read",   "kill",     "exec",     "fstat",        "chdir", 
   "dup",    "getpid",   "sbrk",     "sleep",        "uptime", 
   "open",   "write",    "mknod",    "unlink",       "link",   
-  "mkdir",  "close",    "waitx" ,   "setpriority",  "trace"
+  "mkdir",  "close",    "waitx" ,   "setpriority",  "trace",
+  "schedtrace", "mmap",   "munmap",   "memstat",    "procmem",
+  "spawn"
 };
 
-static int numargs[25] = {
+static int numargs[] = {
   1,  1,  1,   1,   3,  
   3,  1,  2,   2,   1, 
   1,  1,  1,   1,   1, 
   2,  3,  3,   1,   2, 
-  1, 1,   3 ,  2,   1
+  1, 1,   3 ,  2,   1,
+  2,  3,  2,   1,   2,
+  4
 };
 
 void
@@ -169,6 +185,8 @@ syscall(void)
             printf("%d: syscall %s (%d %d) -> %d\n", p->pid, syscall_list[num], x,p->trapframe->a1, p->trapframe->a0);
         if(numargs[num]==3)
             printf("%d: syscall %s (%d %d %d) -> %d\n", p->pid, syscall_list[num], x,p->trapframe->a1,p->trapframe->a2, p->trapframe->a0);
+        if(numargs[num]==4)
+            printf("%d: syscall %s (%d %d %d %d) -> %d\n", p->pid, syscall_list[num], x,p->trapframe->a1,p->trapframe->a2,p->trapframe->a3, p->trapframe->a0);
     } 
   } else 
   {
@@ -23,4 +23,10 @@
 #define SYS_waitx  22
 #define SYS_setpr  22
 #define SYS_setpriority  23
-#define SYS_trace 24
\ No newline at end of file
+#define SYS_trace 24
+#define SYS_schedtrace 25
+#define SYS_mmap   26
+#define SYS_munmap 27
+#define SYS_memstat 28
+#define SYS_procmem 29
+#define SYS_spawn  30
\ No newline at end of file
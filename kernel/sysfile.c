@@ -412,23 +412,22 @@ sys_chdir(void)
   return 0;
 }
 
-uint64
-sys_exec(void)
+// Copy the user argument vector at uargv into argv[MAXARG],
+// a page per string. Returns 0, or -1, in which case the
+// caller must still freeargv().
+static int
+fetchargv(uint64 uargv, char **argv)
 {
-  char path[MAXPATH], *argv[MAXARG];
   int i;
-  uint64 uargv, uarg;
+  uint64 uarg;
 
-  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
-    return -1;
-  }
-  memset(argv, 0, sizeof(argv));
+  memset(argv, 0, MAXARG*sizeof(char*));
   for(i=0;; i++){
-    if(i >= NELEM(argv)){
-      goto bad;
+    if(i >= MAXARG){
+      return -1;
     }
     if(fetchaddr(uargv+sizeof(uint64)*i, (uint64*)&uarg) < 0){
-      goto bad;
+      return -1;
     }
     if(uarg == 0){
       argv[i] = 0;
@@ -436,22 +435,59 @@ sys_exec(void)
     }
     argv[i] = kalloc();
     if(argv[i] == 0)
-      goto bad;
+      return -1;
     if(fetchstr(uarg, argv[i], PGSIZE) < 0)
-      goto bad;
+      return -1;
   }
+  return 0;
+}
 
-  int ret = exec(path, argv);
+static void
+freeargv(char **argv)
+{
+  int i;
 
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
+  for(i = 0; i < MAXARG && argv[i] != 0; i++)
     kfree(argv[i]);
+}
+
+uint64
+sys_exec(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  uint64 uargv;
+  int ret;
 
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0){
+    return -1;
+  }
+  ret = -1;
+  if(fetchargv(uargv, argv) == 0)
+    ret = exec(path, argv);
+  freeargv(argv);
   return ret;
+}
 
- bad:
-  for(i = 0; i < NELEM(argv) && argv[i] != 0; i++)
-    kfree(argv[i]);
-  return -1;
+uint64
+sys_spawn(void)
+{
+  char path[MAXPATH], *argv[MAXARG];
+  struct spawnact acts[NOFILE];
+  uint64 uargv, uacts;
+  int n, ret;
+
+  if(argstr(0, path, MAXPATH) < 0 || argaddr(1, &uargv) < 0 ||
+     argaddr(2, &uacts) < 0 || argint(3, &n) < 0)
+    return -1;
+  if(n < 0 || n > NOFILE)
+    return -1;
+  if(copyin(myproc()->pagetable, (char*)acts, uacts, n*sizeof(acts[0])) < 0)
+    return -1;
+  ret = -1;
+  if(fetchargv(uargv, argv) == 0)
+    ret = spawn(path, argv, acts, n);
+  freeargv(argv);
+  return ret;
 }
 
 uint64
@@ -484,3 +520,29 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr;
+  int len, prot, flags, off;
+  struct file *f = 0;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argint(5, &off) < 0)
+    return -1;
+  if((flags & MAP_ANONYMOUS) == 0 && argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(addr, len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr;
+  int len;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &len) < 0)
+    return -1;
+  return munmap(addr, len);
+}
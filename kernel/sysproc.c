@@ -6,6 +6,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "memstat.h"
 
 uint64
 sys_exit(void)
@@ -134,4 +135,49 @@ uint64 sys_setpriority(void)
   if (argint(1, &pid) < 0)
     return -1;
   return setpriority(newp, pid);
-}
\ No newline at end of file
+}
+
+// drain the scheduler event trace into a user array
+// of struct schedevent; see schedtrace.c.
+uint64
+sys_schedtrace(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+#ifdef SCHEDTRACE
+  return schedtrace_read(addr, n);
+#else
+  return -1;
+#endif
+}
+
+uint64
+sys_memstat(void)
+{
+  uint64 addr;
+  struct memstat st;
+
+  if(argaddr(0, &addr) < 0)
+    return -1;
+  kmemstat(&st);
+  st.pgcache = pgcache_count();
+  st.swapused = swapcount();
+  st.swaptotal = NSWAP;
+  if(copyout(myproc()->pagetable, addr, (char*)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
+
+uint64
+sys_procmem(void)
+{
+  uint64 addr;
+  int n;
+
+  if(argaddr(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return procmem(addr, n);
+}
@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "schedtrace.h"
 
 struct spinlock tickslock;
 uint ticks;
@@ -29,6 +30,29 @@ trapinithart(void)
   w_stvec((uint64)kernelvec);
 }
 
+// Handle a page fault from user space at va: a store to
+// a copy-on-write page, or the first touch of a page that
+// is allocated or read in lazily. Returns 0 if the access
+// can be retried, -1 if the process should be killed.
+static int
+pagefault(struct proc *p, uint64 scause, uint64 va)
+{
+  // reading a page in may sleep for a while, and
+  // scause and stval are safe in our arguments.
+  intr_on();
+
+  if(scause == 15 && uvmcow(p->pagetable, PGROUNDDOWN(va)) == 0)
+    return 0;
+  if(vmfault(p->pagetable, va) != 0){
+    // a TLB may hold the invalid PTE.
+    tlbflush(p, va);
+    return 0;
+  }
+  printf("usertrap(): page fault scause %p pid=%d\n", scause, p->pid);
+  printf("            sepc=%p stval=%p\n", p->trapframe->epc, va);
+  return -1;
+}
+
 //
 // handle an interrupt, exception, or system call from user space.
 // called from trampoline.S
@@ -64,9 +88,17 @@ usertrap(void)
     // so don't enable until done with those registers.
     intr_on();
 
+    p->insyscall = 1;
     syscall();
+    p->insyscall = 0;
+    // pages the call faulted in to copy under a spinlock.
+    if(p->pinend)
+      uvmpin(p, 0, 0);
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if(r_scause() == 12 || r_scause() == 13 || r_scause() == 15){
+    if(pagefault(p, r_scause(), r_stval()) < 0)
+      p->killed = 1;
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -94,9 +126,15 @@ usertrap(void)
       myproc() -> time_spent_currq = 0;
       myproc()->queue_stage = (myproc()->queue_stage+1  == NMLFQ) ? NMLFQ-1 : myproc()->queue_stage + 1;
       myproc()->time_spent_currq = 0;
+      schedtrace_log(SCHED_EV_DEMOTE, myproc(), myproc()->queue_stage);
       yield();
   }
   #endif
+
+  // a timer tick during the system call may have
+  // asked for a reschedule; see kpreempt().
+  preempt_point();
+
   usertrapret();
 }
 
@@ -116,9 +154,16 @@ usertrapret(void)
   // send syscalls, interrupts, and exceptions to trampoline.S
   w_stvec(TRAMPOLINE + (uservec - trampoline));
 
+  // the user page table, tagged with p's ASID.
+  uint64 satp = uvmsatp(p);
+
   // set up trapframe values that uservec will need when
   // the process next re-enters the kernel.
+#ifdef SHAREDPT
+  p->trapframe->kernel_satp = satp;             // p's, which maps the kernel
+#else
   p->trapframe->kernel_satp = r_satp();         // kernel page table
+#endif
   p->trapframe->kernel_sp = p->kstack + PGSIZE; // process's kernel stack
   p->trapframe->kernel_trap = (uint64)usertrap;
   p->trapframe->kernel_hartid = r_tp();         // hartid for cpuid()
@@ -135,9 +180,6 @@ usertrapret(void)
   // set S Exception Program Counter to the saved user pc.
   w_sepc(p->trapframe->epc);
 
-  // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
-
   // jump to trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
   // and switches to user mode with sret.
@@ -159,7 +201,16 @@ kerneltrap()
     panic("kerneltrap: not from supervisor mode");
   if(intr_get() != 0)
     panic("kerneltrap: interrupts enabled");
-  if((which_dev = devintr()) == 0){
+  // a trap in the middle of a direct user copy (see ucopy())
+  // comes in with SUM set. ufault() and kpreempt() may sleep or
+  // yield, and SUM must not go with them to whatever runs next;
+  // restoring sstatus below turns it back on.
+  w_sstatus(sstatus & ~SSTATUS_SUM);
+  if((which_dev = devintr()) != 0){
+    // ok
+  } else if((scause == 13 || scause == 15) && ufault(scause, r_stval(), &sepc) == 0){
+    // a page fault in copyin() or copyout(); see ufault().
+  } else {
     printf("scause %p\n", scause);
     printf("sepc=%p stval=%p\n", r_sepc(), r_stval());
     panic("kerneltrap");
@@ -171,7 +222,7 @@ kerneltrap()
   #ifndef MLFQ
   if(which_dev == 2 && myproc() != 0 && myproc()->state == RUNNING)
   {
-    yield();
+    kpreempt();
   }
   #endif
   #endif
@@ -183,7 +234,8 @@ kerneltrap()
       myproc() -> time_spent_currq = 0;
       myproc()->queue_stage = (myproc()->queue_stage+1  == NMLFQ) ? NMLFQ-1 : myproc()->queue_stage + 1;
       myproc()->time_spent_currq = 0;
-      yield();
+      schedtrace_log(SCHED_EV_DEMOTE, myproc(), myproc()->queue_stage);
+      kpreempt();
   }
   #endif
 
@@ -5,6 +5,10 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
+#include "fcntl.h"
+#include "memstat.h"
 
 /*
  * the kernel's page table.
@@ -25,27 +29,32 @@ kvmmake(void)
   memset(kpgtbl, 0, PGSIZE);
 
   // uart registers
-  kvmmap(kpgtbl, UART0, UART0, PGSIZE, PTE_R | PTE_W);
+  kvmmap(kpgtbl, UART0, UART0 - KDEV, PGSIZE, PTE_R | PTE_W);
 
   // virtio mmio disk interface
-  kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
+  kvmmap(kpgtbl, VIRTIO0, VIRTIO0 - KDEV, PGSIZE, PTE_R | PTE_W);
 
   // PLIC
-  kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
+  kvmmap(kpgtbl, PLIC, PLIC - KDEV, 0x400000, PTE_R | PTE_W);
 
   // map kernel text executable and read-only.
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
-  // map kernel data and the physical RAM we'll make use of.
+  // map kernel data and the physical RAM we'll make use of;
+  // past the first 2 MiB boundary, mappages() uses megapages.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
   // the highest virtual address in the kernel.
   kvmmap(kpgtbl, TRAMPOLINE, (uint64)trampoline, PGSIZE, PTE_R | PTE_X);
 
-  // map kernel stacks
-  proc_mapstacks(kpgtbl);
-  
+  // kernel stacks are mapped and unmapped as processes come
+  // and go (see kvmmapstack()). make the page-table pages for
+  // every stack slot now, so that doing so never allocates.
+  for(int i = 0; i < MAXPROC; i++)
+    if(walk(kpgtbl, KSTACK(i), 1) == 0)
+      panic("kvmmake: stacks");
+
   return kpgtbl;
 }
 
@@ -65,6 +74,157 @@ kvminithart()
   sfence_vma();
 }
 
+// Address-space IDs. Each process's page table gets an ASID,
+// which tags its TLB entries, so that switching satp between
+// it and the kernel's page table (ASID 0) flushes nothing.
+// ASIDs are handed out in order; when they run out, a new
+// generation starts, and each hart flushes its whole TLB
+// before it uses one of the new generation's. A process keeps
+// its ASID until exec() or the next generation, so a hart
+// that ran it may still hold entries for its old PTEs:
+// tlbflush() notes that in p->tlbstale.
+struct {
+  struct spinlock lock;
+  uint n;               // ASIDs the hardware has, or 1 if none
+  uint next;            // next one to hand out
+  uint64 gen;           // current generation
+} asids;
+
+// Find out how many ASID bits satp has: the ones that stay
+// set when written with all 1s. Call after kvminithart().
+void
+asidinit(void)
+{
+  uint64 satp;
+
+  initlock(&asids.lock, "asids");
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASID_MASK);
+  satp = r_satp();
+  w_satp(MAKE_SATP(kernel_pagetable));
+  sfence_vma();
+  asids.n = ((satp & SATP_ASID_MASK) >> SATP_ASID_SHIFT) + 1;
+  asids.next = 1;
+  asids.gen = 1;
+}
+
+// Return the satp for p's page table, tagged with p's ASID,
+// giving p a new one if it has none from this generation.
+// Flushes whatever this hart's TLB may hold for that ASID
+// that is stale. Without ASIDs, trampoline.S flushes the TLB
+// on every satp switch instead. Interrupts must be off.
+uint64
+uvmsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen;
+
+  if(asids.n <= 1)
+    return MAKE_SATP(p->pagetable);
+
+  acquire(&asids.lock);
+  if(p->asidgen != asids.gen){
+    if(asids.next == asids.n){
+      asids.gen++;
+      asids.next = 1;
+    }
+    p->asid = asids.next++;
+    p->asidgen = asids.gen;
+    p->tlbstale = 0;
+  }
+  gen = asids.gen;
+  release(&asids.lock);
+
+  if(c->asidgen != gen){
+    sfence_vma();
+    c->asidgen = gen;
+  } else if(p->tlbstale & (1U << cpuid())){
+    sfence_vma_asid(p->asid);
+  }
+  p->tlbstale &= ~(1U << cpuid());
+  return MAKE_SATP_ASID(p->pagetable, p->asid);
+}
+
+// p's PTE for va has changed or gone. Flush this hart's TLB
+// entry for it if p is the process running here, and have
+// every other hart flush p's ASID before it next runs p.
+void
+tlbflush(struct proc *p, uint64 va)
+{
+  push_off();
+  if(p == myproc()){
+    sfence_vma_page(va, p->asid);
+    p->tlbstale = ~(1U << cpuid());
+  } else {
+    p->tlbstale = ~0U;
+  }
+  pop_off();
+}
+
+// tlbflush() for a change to pagetable, if it is the current
+// process's. Any other user page table is being built, like
+// exec()'s, or freed, and has no ASID in use.
+static void
+uvmflush(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(p && p->pagetable == pagetable)
+    tlbflush(p, va);
+}
+
+#ifdef SHAREDPT
+// Give a process's page table the kernel's mappings of
+// [KERNBASE, KERNTOP), by pointing it at the kernel's own
+// level-1 page-table page for them; see memlayout.h.
+void
+kvmshare(pagetable_t pagetable)
+{
+  pagetable[PX(2, KERNBASE)] = kernel_pagetable[PX(2, KERNBASE)];
+}
+
+// Undo kvmshare(), so that freewalk() leaves the kernel's
+// page-table pages alone.
+void
+kvmunshare(pagetable_t pagetable)
+{
+  pagetable[PX(2, KERNBASE)] = 0;
+}
+
+// Run this hart on p's page table, or on the kernel's if p
+// is 0, for the scheduler and exec().
+void
+uvmswitch(struct proc *p)
+{
+  push_off();
+  w_satp(p ? uvmsatp(p) : MAKE_SATP(kernel_pagetable));
+  // without ASIDs, everything is under ASID 0.
+  if(asids.n <= 1)
+    sfence_vma();
+  pop_off();
+}
+#endif
+
+// Like walk() below, but stop at the level-1 PTE
+// for va, which may be a megapage.
+static pte_t *
+walkmega(pagetable_t pagetable, uint64 va, int alloc)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    panic("walk");
+
+  pte = &pagetable[PX(2, va)];
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
+  }
+  return &pagetable[PX(1, va)];
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -77,22 +237,24 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A leaf PTE at level 1 maps a 2 MiB megapage, and has
+// no level-0 PTEs under it; walk() returns that PTE.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
 {
-  if(va >= MAXVA)
-    panic("walk");
+  pte_t *pte;
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
-    if(*pte & PTE_V) {
-      pagetable = (pagetable_t)PTE2PA(*pte);
-    } else {
-      if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
-        return 0;
-      memset(pagetable, 0, PGSIZE);
-      *pte = PA2PTE(pagetable) | PTE_V;
-    }
+  if((pte = walkmega(pagetable, va, alloc)) == 0)
+    return 0;
+  if(PTE_LEAF(*pte))
+    return pte;
+  if(*pte & PTE_V) {
+    pagetable = (pagetable_t)PTE2PA(*pte);
+  } else {
+    if(!alloc || (pagetable = (pde_t*)kzalloc()) == 0)
+      return 0;
+    *pte = PA2PTE(pagetable) | PTE_V;
   }
   return &pagetable[PX(0, va)];
 }
@@ -117,6 +279,9 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  // the page of va within a megapage.
+  if(pte == walkmega(pagetable, va, 0))
+    pa += PGROUNDDOWN(va) - MEGAROUNDDOWN(va);
   return pa;
 }
 
@@ -130,9 +295,36 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
     panic("kvmmap");
 }
 
+// allocate and map a kernel stack page at va, one of the
+// KSTACK() slots, in the kernel page table. other harts may
+// still need an sfence_vma before using it; see kstacksync().
+// returns 0 on success, -1 if out of memory.
+int
+kvmmapstack(uint64 va)
+{
+  char *pa;
+
+  if((pa = kalloc()) == 0)
+    return -1;
+  if(mappages(kernel_pagetable, va, PGSIZE, (uint64)pa, PTE_R | PTE_W) != 0)
+    panic("kvmmapstack");
+  sfence_vma();
+  return 0;
+}
+
+// unmap and free the kernel stack page at va.
+void
+kvmunmapstack(uint64 va)
+{
+  uvmunmap(kernel_pagetable, va, 1, 1);
+  sfence_vma();
+}
+
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Where va and pa are both 2 MiB-aligned, and
+// at least 2 MiB is left to map, uses a megapage if nothing is
+// mapped there yet. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
@@ -146,6 +338,18 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
+    if(a % MEGAPGSIZE == 0 && pa % MEGAPGSIZE == 0 && last - a >= MEGAPGSIZE - PGSIZE){
+      if((pte = walkmega(pagetable, a, 1)) == 0)
+        return -1;
+      if(*pte == 0){
+        *pte = PA2PTE(pa) | perm | PTE_V;
+        if(last - a == MEGAPGSIZE - PGSIZE)
+          break;
+        a += MEGAPGSIZE;
+        pa += MEGAPGSIZE;
+        continue;
+      }
+    }
     if((pte = walk(pagetable, a, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
@@ -160,8 +364,11 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
-// Optionally free the physical memory.
+// page-aligned. Pages never touched since sbrk() have no
+// mapping, and are skipped. A megapage must be removed
+// whole; uvmsplit() one that is not.
+// Optionally free the physical memory. A swapped-out page's
+// swap slot is always freed.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 {
@@ -173,29 +380,70 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
+    if(*pte & PTE_SWAP){
+      swapfree(PTE2SLOT(*pte));
+      *pte = 0;
+      continue;
+    }
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(pte == walkmega(pagetable, a, 0)){
+      if(a % MEGAPGSIZE != 0 || a + MEGAPGSIZE > va + npages*PGSIZE)
+        panic("uvmunmap: part of a megapage");
+      if(do_free)
+        kfree_pages((void*)PTE2PA(*pte), MEGAORDER);
+      *pte = 0;
+      uvmflush(pagetable, a);
+      a += MEGAPGSIZE - PGSIZE;
+      continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
     }
     *pte = 0;
+    uvmflush(pagetable, a);
   }
 }
 
+// If va lies in a megapage, split the megapage into 4096-byte
+// pages, so that they can be unmapped or shared one by one.
+// Returns 0, or -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  pagetable_t t;
+  uint64 pa;
+  int i;
+
+  if(va >= MAXVA)
+    return 0;
+  if((pte = walkmega(pagetable, va, 0)) == 0 || !PTE_LEAF(*pte))
+    return 0;
+  if((t = (pagetable_t)kalloc()) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  ksplit_pages((void*)pa, MEGAORDER);
+  for(i = 0; i < 512; i++)
+    t[i] = PA2PTE(pa + i*PGSIZE) | PTE_FLAGS(*pte);
+  *pte = PA2PTE(t) | PTE_V;
+  uvmflush(pagetable, va);
+  return 0;
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
 uvmcreate()
 {
   pagetable_t pagetable;
-  pagetable = (pagetable_t) kalloc();
+  pagetable = (pagetable_t) kzalloc();
   if(pagetable == 0)
     return 0;
-  memset(pagetable, 0, PGSIZE);
   return pagetable;
 }
 
@@ -228,12 +476,11 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
-    mem = kalloc();
+    mem = kzalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
       return 0;
     }
-    memset(mem, 0, PGSIZE);
     if(mappages(pagetable, a, PGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
       kfree(mem);
       uvmdealloc(pagetable, a, oldsz);
@@ -263,6 +510,7 @@ uvmdealloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
 // Recursively free page-table pages.
 // All leaf mappings must already have been removed.
+// Each page is left zeroed, for kzfree() to keep.
 void
 freewalk(pagetable_t pagetable)
 {
@@ -273,12 +521,12 @@ freewalk(pagetable_t pagetable)
       // this PTE points to a lower-level page table.
       uint64 child = PTE2PA(pte);
       freewalk((pagetable_t)child);
-      pagetable[i] = 0;
     } else if(pte & PTE_V){
       panic("freewalk: leaf");
     }
+    pagetable[i] = 0;
   }
-  kfree((void*)pagetable);
+  kzfree((void*)pagetable);
 }
 
 // Free user memory pages,
@@ -291,68 +539,580 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Move the user mappings that exec() built in the top-level
+// page table new into old, the process's own, whose user
+// memory has already been unmapped, and free new. Entries
+// that the two share (see proc_execpagetable()) stay. This
+// keeps old's top-level page, and its page-table pages for
+// the trampoline and trapframe, for the new program.
+void
+uvmadopt(pagetable_t old, pagetable_t new)
+{
+  int i;
+
+  for(i = 0; i < 512; i++){
+    if(new[i] != old[i]){
+      if(old[i] & PTE_V)
+        freewalk((pagetable_t)PTE2PA(old[i]));
+      old[i] = new[i];
+    }
+    new[i] = 0;
+  }
+  kzfree((void*)new);
+}
+
+// Add up the user pages of the page-table page pt, at the
+// given level, and of the ones below it, and the pages
+// themselves, into *st.
+static void
+uvmstatwalk(pagetable_t pt, int level, struct procmem *st)
+{
+  pte_t pte;
+  int i;
+
+  st->ptpages++;
+  for(i = 0; i < 512; i++){
+    pte = pt[i];
+#ifdef SHAREDPT
+    // the kernel's; see kvmshare().
+    if(level == 2 && i == PX(2, KERNBASE))
+      continue;
+#endif
+    if(pte & PTE_SWAP)
+      st->swapped++;
+    if((pte & PTE_V) == 0)
+      continue;
+    if(!PTE_LEAF(pte))
+      uvmstatwalk((pagetable_t)PTE2PA(pte), level - 1, st);
+    else if(pte & PTE_U)
+      st->rss += level == 1 ? MEGAPGSIZE / PGSIZE : 1;
+  }
+}
+
+// Count a process's resident and swapped-out user pages, and
+// its page-table pages, into *st. Nothing may be changing
+// the page table.
+void
+uvmstat(pagetable_t pagetable, struct procmem *st)
+{
+  uvmstatwalk(pagetable, 2, st);
+}
+
+// Given a parent process's page table, share
+// its memory in [va, end) with a child's page table.
+// Copies the page table only: unless share is set,
+// writable pages become read-only and PTE_COW in both,
+// and uvmcow() copies one when either side stores to it.
+// With share set (MAP_SHARED), both keep storing to the
+// same pages.
 // returns 0 on success, -1 on failure.
-// frees any allocated pages on failure.
+// drops the child's references on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 va, uint64 end, int share)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = va; i < end; i += PGSIZE){
+    // copy-on-write works on 4096-byte pages.
+    if(i % MEGAPGSIZE == 0 && uvmsplit(old, i) < 0)
+      goto err;
+    // skip pages not touched yet; see vmfault().
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    // the child shares a swapped-out page once it is back.
+    // From then on interrupts are off, so that this process
+    // isn't preempted and swapout() can't take the page again
+    // until the child has its reference. mappages() may
+    // kalloc(), but swapout() only takes unshared pages.
+    push_off();
+    while(*pte & PTE_SWAP){
+      pop_off();
+      if(swapin(old, i) == 0)
+        goto err;
+      push_off();
+    }
+    if((*pte & PTE_V) == 0){
+      pop_off();
+      continue;
+    }
+    // share the page; a store by either side copies it.
+    if(!share && (*pte & PTE_W)){
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      uvmflush(old, i);
+    }
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    // the child writes back only what it dirties itself.
+    flags = PTE_FLAGS(*pte) & ~PTE_D;
+    kdup((void*)pa);
+    pop_off();
+    if(mappages(new, i, PGSIZE, pa, flags) != 0){
+      kfree((void*)pa);
       goto err;
     }
+    preempt_point();
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
-// mark a PTE invalid for user access.
-// used by exec for the user stack guard page.
+// Try to map the 2 MiB around heap page va as one megapage.
+// All of it must be heap, clear of any VMA, and untouched.
+// Returns va's physical address, or 0 to fall back to a
+// 4096-byte page.
+static uint64
+megafault(struct proc *p, uint64 va)
+{
+  struct vma *v;
+  uint64 a;
+  char *mem;
+
+  a = MEGAROUNDDOWN(va);
+  if(a + MEGAPGSIZE > p->sz || walk(p->pagetable, a, 0) != 0)
+    return 0;
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->flags && v->start < a + MEGAPGSIZE && v->end > a)
+      return 0;
+  if((mem = kalloc_pages(MEGAORDER)) == 0)
+    return 0;
+  memset(mem, 0, MEGAPGSIZE);
+  if(mappages(p->pagetable, a, MEGAPGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U) != 0){
+    kfree_pages(mem, MEGAORDER);
+    return 0;
+  }
+  return (uint64)mem + (va - a);
+}
+
+// Handle a fault at a page of the current process that has
+// not been touched yet: a page of an exec()ed segment or an
+// mmap()ed file, which comes from the file, or of the heap or
+// an anonymous mapping, which start zeroed. A page that was
+// swapped out is read back in by swapin().
+// Whole pages of the file are shared with other processes
+// mapping it through pgcache.c, copy-on-write unless the
+// mapping is MAP_SHARED.
+// May sleep, so the caller must hold no spinlocks.
+// Returns the page's physical address, or 0 if va is not
+// such a page, or there is no memory for it, or the read fails.
+uint64
+vmfault(pagetable_t pagetable, uint64 va)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+  uint64 pa;
+  char *mem;
+  uint n;
+  int perm;
+
+  va = PGROUNDDOWN(va);
+  if(p == 0 || pagetable != p->pagetable || va >= MAXVA)
+    return 0;
+  // mapped already, e.g. the trapframe, which isn't PTE_U.
+  if((pte = walk(pagetable, va, 0)) != 0 && (*pte & PTE_V))
+    return 0;
+  if(pte && (*pte & PTE_SWAP))
+    return swapin(pagetable, va);
+
+  for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+    if(v->flags && va >= v->start && va < v->end)
+      break;
+  if(v == &p->vmas[NVMA]){
+    v = 0;
+    if(va >= p->sz)
+      return 0;
+    if((pa = megafault(p, va)) != 0)
+      return pa;
+  }
+
+  if(v && va - v->start + PGSIZE <= v->filesz){
+    if((pa = pgcache_get(v->ip, v->off + (va - v->start), v->flags & MAP_SHARED)) == 0)
+      return 0;
+    perm = v->perm;
+    // a MAP_SHARED mapping stores into the cached page itself.
+    if((perm & PTE_W) && (v->flags & MAP_SHARED) == 0)
+      perm = (perm & ~PTE_W) | PTE_COW;
+  } else {
+    if((mem = kzalloc()) == 0)
+      return 0;
+    // the end of a segment's file bytes: read them in,
+    // leaving the rest of the page zero.
+    if(v && va - v->start < v->filesz){
+      n = v->filesz - (va - v->start);
+      ilock(v->ip);
+      if(readi(v->ip, 0, (uint64)mem, v->off + (va - v->start), n) != n){
+        iunlock(v->ip);
+        kfree(mem);
+        return 0;
+      }
+      iunlock(v->ip);
+    }
+    pa = (uint64)mem;
+    perm = v ? v->perm : PTE_W|PTE_X|PTE_R|PTE_U;
+  }
+
+  // PTE_A, so that swapout() doesn't take the page before
+  // the process has even used it.
+  if(mappages(pagetable, va, PGSIZE, pa, perm | PTE_A) != 0){
+    kfree((void*)pa);
+    return 0;
+  }
+  return pa;
+}
+
+// Fault in the missing pages of [va, va+len) in the current
+// process, so that a later copyin() or copyout() on them needs
+// no vmfault(). Called before locking an inode, since a fault
+// may need to lock another one (or the same one) to read a
+// program page, and before taking a spinlock to copy under.
+// Callers fault in only what the copy will touch, a chunk at
+// a time, so as not to fill in untouched heap pages that a
+// short read never reaches. Stops at the first page that
+// can't be had; the copy reports the error.
+// The range stays pinned, so that swapout() can't take the
+// pages back before the copy, until the next call or the end
+// of the system call.
 void
-uvmclear(pagetable_t pagetable, uint64 va)
+uvmprefault(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 a;
+
+  if(p && pagetable == p->pagetable)
+    uvmpin(p, PGROUNDDOWN(va), va + len < va ? MAXVA : va + len);
+  for(a = PGROUNDDOWN(va); a < va + len && a < MAXVA; a += PGSIZE){
+    if(walkaddr(pagetable, a) == 0 && vmfault(pagetable, a) == 0)
+      break;
+  }
+}
+
+// Set the range [start, end) of the current process p's
+// memory that swapout() must leave alone. Only p itself
+// sets it, while running, and swapout() on another CPU only
+// looks at p once it has stopped, under p->lock, so that
+// needs no lock; interrupts are off so that p isn't
+// preempted with half the range set.
+void
+uvmpin(struct proc *p, uint64 start, uint64 end)
+{
+  push_off();
+  p->pinstart = start;
+  p->pinend = end;
+  pop_off();
+}
+
+// The current process's pinned range before a copy.
+struct upin {
+  struct proc *p;       // 0 if the copy isn't to its memory
+  uint64 start, end;
+};
+
+// Pin [va, va+len) of pagetable for a copy, if it is the
+// current process's, on top of what is pinned already. The
+// copy may sleep in vmfault() or be preempted, and swapout()
+// must not take a page while the copy holds its address.
+static void
+upin(struct upin *u, pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 start, end;
+
+  u->p = 0;
+  if(p == 0 || pagetable != p->pagetable)
+    return;
+  u->p = p;
+  u->start = p->pinstart;
+  u->end = p->pinend;
+  start = PGROUNDDOWN(va);
+  end = va + len < va ? MAXVA : va + len;
+  if(u->start < u->end){
+    if(u->start < start)
+      start = u->start;
+    if(u->end > end)
+      end = u->end;
+  }
+  uvmpin(p, start, end);
+}
+
+// Put back the range pinned before upin().
+static void
+uunpin(struct upin *u)
+{
+  if(u->p)
+    uvmpin(u->p, u->start, u->end);
+}
+
+// Drop the inode references held by VMAs that were never
+// faulted in, such as exec()'s before it commits; see
+// vmaunmapall() for ones that may have pages.
+// Must be called inside a transaction, since iput() may
+// free the inode.
+void
+vmaclear(struct vma *vmas)
+{
+  struct vma *v;
+
+  for(v = vmas; v < &vmas[NVMA]; v++){
+    if(v->ip)
+      iput(v->ip);
+    memset(v, 0, sizeof(*v));
+  }
+}
+
+// Handle a store to the copy-on-write page at va: give
+// pagetable its own writable copy, or, if nothing else
+// maps the page any more, just make it writable again.
+// Returns 0 on success, -1 if va is not a COW page or
+// there is no memory for the copy.
+int
+uvmcow(pagetable_t pagetable, uint64 va)
 {
   pte_t *pte;
-  
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
   pte = walk(pagetable, va, 0);
-  if(pte == 0)
-    panic("uvmclear");
-  *pte &= ~PTE_U;
+  if(pte == 0 || (*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) & ~PTE_COW) | PTE_W;
+  if(krefcount((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    uvmflush(pagetable, va);
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  uvmflush(pagetable, va);
+  kfree((void*)pa);
+  return 0;
 }
 
-// Copy from kernel to user.
-// Copy len bytes from src to virtual address dstva in a given page table.
-// Return 0 on success, -1 on error.
+// Handle a page fault that kerneltrap() took at user address
+// va during a direct user copy (see ucopy()): fault the page
+// in as usertrap() would, or, if it can't be had, mark the
+// copy failed and step *sepc past the load or store. Returns
+// -1 if the fault wasn't during a user copy. kerneltrap() has
+// cleared SUM, since faulting a page in may sleep.
 int
-copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+ufault(uint64 scause, uint64 va, uint64 *sepc)
+{
+  struct proc *p = myproc();
+  int noff, ok;
+
+  if(p == 0 || !p->ucopy || va >= MAXVA)
+    return -1;
+  push_off();
+  noff = mycpu()->noff;
+  pop_off();
+
+  ok = 0;
+  if(!p->ufail){
+    if(scause == 15 && uvmcow(p->pagetable, PGROUNDDOWN(va)) == 0){
+      ok = 1;
+    } else if(noff == 1){
+      // vmfault() may sleep, which it can't under a spinlock;
+      // callers that copy under one fault the pages in first.
+      intr_on();
+      ok = vmfault(p->pagetable, va) != 0;
+      intr_off();
+    }
+  }
+  if(ok){
+    tlbflush(p, va);
+    return 0;
+  }
+  p->ufail = 1;
+  *sepc += (*(ushort*)*sepc & 3) == 3 ? 4 : 2;
+  return 0;
+}
+
+// A cursor over a user page table, for copyout(), copyin()
+// and copyinstr(). It keeps the level-0 page-table page of
+// the 2 MiB it last walked to, so that going on to the next
+// page usually just indexes into it. vmfault() never frees
+// or replaces a level-0 page, so the cursor stays good
+// across faults.
+struct ucursor {
+  pagetable_t pagetable;
+  uint64 base;          // first va that l0 maps
+  pagetable_t l0;       // 0 if none, or the last walk hit a megapage
+};
+
+static void
+ucursorinit(struct ucursor *c, pagetable_t pagetable)
+{
+  c->pagetable = pagetable;
+  c->l0 = 0;
+}
+
+// Return the PTE for va, as walk() would without allocating.
+static pte_t*
+ucursorpte(struct ucursor *c, uint64 va)
+{
+  pte_t *pte;
+
+  if(c->l0 && MEGAROUNDDOWN(va) == c->base)
+    return &c->l0[PX(0, va)];
+  if(va >= MAXVA || (pte = walkmega(c->pagetable, va, 0)) == 0)
+    return 0;
+  if((*pte & PTE_V) == 0)
+    return 0;
+  if(PTE_LEAF(*pte)){
+    c->l0 = 0;
+    return pte;
+  }
+  c->l0 = (pagetable_t)PTE2PA(*pte);
+  c->base = MEGAROUNDDOWN(va);
+  return &c->l0[PX(0, va)];
+}
+
+// Return the physical address of user page va, as walkaddr()
+// does, or 0 if it is not mapped for the user.
+static uint64
+ucursoraddr(struct ucursor *c, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+
+  pte = ucursorpte(c, va);
+  if(pte == 0 || (*pte & (PTE_V|PTE_U)) != (PTE_V|PTE_U))
+    return 0;
+  pa = PTE2PA(*pte);
+  // the page of va within a megapage.
+  if(c->l0 == 0)
+    pa += PGROUNDDOWN(va) - MEGAROUNDDOWN(va);
+  return pa;
+}
+
+#ifdef SHAREDPT
+// With SHAREDPT the kernel runs on the current process's page
+// table, so copies to and from its memory are plain loads and
+// stores through the user addresses, with sstatus.SUM set to
+// let the kernel touch PTE_U pages. A page that isn't there
+// yet, or is copy-on-write, faults into kerneltrap(), which
+// calls ufault().
+
+// May [va, va+len) of pagetable be copied directly? It must
+// be the current process's memory below p->sz, or in one of
+// its mmap()s; other addresses may reach kernel pages, such
+// as the trapframe, which the loads and stores would not
+// fault on. With SUM set they don't fault on a page without
+// PTE_U either; exec() and mmap() see that user memory has
+// none (see exec.c).
+static int
+udirect(pagetable_t pagetable, uint64 va, uint64 len)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+
+  if(p == 0 || pagetable != p->pagetable || va + len < va)
+    return 0;
+  if(va + len > p->sz){
+    for(v = p->vmas; v < &p->vmas[NVMA]; v++)
+      if(v->flags && va >= v->start && va + len <= v->end)
+        break;
+    if(v == &p->vmas[NVMA])
+      return 0;
+  }
+  return 1;
+}
+
+static void
+ubegin(struct proc *p)
+{
+  p->ufail = 0;
+  p->ucopy = 1;
+  w_sstatus(r_sstatus() | SSTATUS_SUM);
+}
+
+static void
+uend(struct proc *p)
+{
+  w_sstatus(r_sstatus() & ~SSTATUS_SUM);
+  p->ucopy = 0;
+}
+
+// Copy len bytes from src to dst, one of which udirect()
+// has passed. A page at a time, so that a failed copy stops
+// soon. Return 0 on success, -1 on error.
+static int
+ucopy(char *dst, char *src, uint64 len)
+{
+  struct proc *p = myproc();
+  uint64 n;
+
+  ubegin(p);
+  for(; len > 0 && !p->ufail; len -= n){
+    n = len < PGSIZE ? len : PGSIZE;
+    memmove(dst, src, n);
+    dst += n;
+    src += n;
+  }
+  uend(p);
+  return p->ufail ? -1 : 0;
+}
+
+// Copy a null-terminated string from src, which udirect()
+// has passed for max bytes, to dst.
+// Return 0 on success, -1 on error.
+static int
+ucopystr(char *dst, char *src, uint64 max)
+{
+  struct proc *p = myproc();
+  int r;
+
+  r = -1;
+  ubegin(p);
+  for(; max > 0 && !p->ufail; max--){
+    if((*dst++ = *src++) == '\0'){
+      r = 0;
+      break;
+    }
+  }
+  uend(p);
+  return p->ufail ? -1 : r;
+}
+#endif
+
+// copyout(), with the range pinned.
+static int
+copyoutpin(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
+  struct ucursor c;
   uint64 n, va0, pa0;
+  pte_t *pte;
 
+#ifdef SHAREDPT
+  if(udirect(pagetable, dstva, len))
+    return ucopy((char *)dstva, src, len);
+#endif
+  ucursorinit(&c, pagetable);
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(va0 >= MAXVA)
+      return -1;
+    if(ucursoraddr(&c, va0) == 0 && vmfault(pagetable, va0) == 0)
+      return -1;
+    // the page may be shared copy-on-write,
+    // or a read-only page of a program.
+    pte = ucursorpte(&c, va0);
+    if((*pte & PTE_COW) && uvmcow(pagetable, va0) < 0)
       return -1;
+    if((*pte & PTE_W) == 0)
+      return -1;
+    // as the MMU would, so munmap() writes it back.
+    *pte |= PTE_D;
+    pa0 = ucursoraddr(&c, va0);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
@@ -365,18 +1125,22 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   return 0;
 }
 
-// Copy from user to kernel.
-// Copy len bytes to dst from virtual address srcva in a given page table.
-// Return 0 on success, -1 on error.
-int
-copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+// copyin(), with the range pinned.
+static int
+copyinpin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
+  struct ucursor c;
   uint64 n, va0, pa0;
 
+#ifdef SHAREDPT
+  if(udirect(pagetable, srcva, len))
+    return ucopy(dst, (char *)srcva, len);
+#endif
+  ucursorinit(&c, pagetable);
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pa0 = ucursoraddr(&c, va0);
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -390,45 +1154,100 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   return 0;
 }
 
-// Copy a null-terminated string from user to kernel.
-// Copy bytes to dst from virtual address srcva in a given page table,
-// until a '\0', or max.
-// Return 0 on success, -1 on error.
-int
-copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+// true if one of the 8 bytes of w is 0.
+#define HASZERO(w) (((w) - 0x0101010101010101UL) & ~(w) & 0x8080808080808080UL)
+
+// copyinstr(), with the range pinned.
+static int
+copyinstrpin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
-  uint64 n, va0, pa0;
-  int got_null = 0;
+  struct ucursor c;
+  uint64 n, va0, pa0, w;
+  char *p;
 
-  while(got_null == 0 && max > 0){
+#ifdef SHAREDPT
+  if(udirect(pagetable, srcva, max))
+    return ucopystr(dst, (char *)srcva, max);
+#endif
+  ucursorinit(&c, pagetable);
+  while(max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    pa0 = ucursoraddr(&c, va0);
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
 
-    char *p = (char *) (pa0 + (srcva - va0));
-    while(n > 0){
-      if(*p == '\0'){
-        *dst = '\0';
-        got_null = 1;
-        break;
-      } else {
-        *dst = *p;
+    p = (char *) (pa0 + (srcva - va0));
+    // a word at a time while p and dst are aligned and
+    // the word holds no '\0'.
+    if(((uint64)p ^ (uint64)dst) % 8 == 0){
+      for(; n > 0 && (uint64)p % 8 != 0; n--, max--){
+        if((*dst++ = *p++) == '\0')
+          return 0;
       }
-      --n;
-      --max;
-      p++;
-      dst++;
+      for(; n >= 8; n -= 8, max -= 8){
+        w = *(uint64*)p;
+        if(HASZERO(w))
+          break;
+        *(uint64*)dst = w;
+        p += 8;
+        dst += 8;
+      }
+    }
+    for(; n > 0; n--, max--){
+      if((*dst++ = *p++) == '\0')
+        return 0;
     }
 
     srcva = va0 + PGSIZE;
   }
-  if(got_null){
-    return 0;
-  } else {
-    return -1;
-  }
+  return -1;
+}
+
+// Copy from kernel to user.
+// Copy len bytes from src to virtual address dstva in a given page table.
+// Return 0 on success, -1 on error.
+int
+copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
+{
+  struct upin u;
+  int r;
+
+  upin(&u, pagetable, dstva, len);
+  r = copyoutpin(pagetable, dstva, src, len);
+  uunpin(&u);
+  return r;
+}
+
+// Copy from user to kernel.
+// Copy len bytes to dst from virtual address srcva in a given page table.
+// Return 0 on success, -1 on error.
+int
+copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
+{
+  struct upin u;
+  int r;
+
+  upin(&u, pagetable, srcva, len);
+  r = copyinpin(pagetable, dst, srcva, len);
+  uunpin(&u);
+  return r;
+}
+
+// Copy a null-terminated string from user to kernel.
+// Copy bytes to dst from virtual address srcva in a given page table,
+// until a '\0', or max.
+// Return 0 on success, -1 on error.
+int
+copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
+{
+  struct upin u;
+  int r;
+
+  upin(&u, pagetable, srcva, max);
+  r = copyinstrpin(pagetable, dst, srcva, max);
+  uunpin(&u);
+  return r;
 }
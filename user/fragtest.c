@@ -0,0 +1,159 @@
+// Buddy allocator fragmentation stress.
+//
+//   fragtest [nchild]
+//
+// nchild processes (default 4, at most 5) take turns growing
+// their heaps by one touched page, so that their pages
+// interleave in physical memory. Then every other one exits,
+// which leaves the free memory full of one-page holes, and
+// then the rest. Prints the free blocks of each order, from
+// memstat(), after each step. Once everything has exited, the
+// holes must have joined back up: the free memory in 2 MiB
+// blocks or bigger must be what it was at the start.
+//
+// The whole run is done twice, and only the second is checked,
+// so that pages the first one leaves in the program page
+// cache don't count.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+#define NPAGE    1024  // pages per child
+#define MAXCHILD 5     // each needs a pipe, and NOFILE is 16
+
+int ring[MAXCHILD][2], done[2];
+
+void
+child(int i, int n)
+{
+  int r;
+  char c, *a;
+
+  for(r = 0; r < NPAGE; r++){
+    if(read(ring[i][0], &c, 1) != 1)
+      exit(1);
+    if((a = sbrk(PGSIZE)) == (char*)-1){
+      fprintf(2, "fragtest: sbrk failed\n");
+      exit(1);
+    }
+    *a = c;
+    // the last child's last turn ends the ring.
+    if(i < n-1 || r < NPAGE-1)
+      write(ring[(i+1) % n][1], "t", 1);
+  }
+  write(done[1], "d", 1);
+  // wait to be told to exit.
+  read(ring[i][0], &c, 1);
+  exit(0);
+}
+
+// free pages, all of them or in blocks of order minorder or more.
+int
+freepages(struct memstat *st, int minorder)
+{
+  int i, n;
+
+  n = minorder == 0 ? st->cached : 0;
+  for(i = minorder; i <= MAXORDER; i++)
+    n += st->nfree[i] << i;
+  return n;
+}
+
+void
+show(char *when, int verbose)
+{
+  struct memstat st;
+  int i;
+
+  if(!verbose)
+    return;
+  memstat(&st);
+  printf("%s:", when);
+  for(i = 0; i <= MAXORDER; i++)
+    printf(" %d", st.nfree[i]);
+  printf(" (+%d on cpu lists), %d pages free\n", st.cached, freepages(&st, 0));
+}
+
+// returns 0 if the free memory joined back up.
+int
+run(int n, int verbose)
+{
+  struct memstat before, after;
+  int i, pids[MAXCHILD];
+  char c;
+
+  memstat(&before);
+  show("start", verbose);
+
+  if(pipe(done) < 0){
+    fprintf(2, "fragtest: pipe failed\n");
+    exit(1);
+  }
+  for(i = 0; i < n; i++){
+    if(pipe(ring[i]) < 0){
+      fprintf(2, "fragtest: pipe failed\n");
+      exit(1);
+    }
+  }
+  for(i = 0; i < n; i++){
+    if((pids[i] = fork()) < 0){
+      fprintf(2, "fragtest: fork failed\n");
+      exit(1);
+    }
+    if(pids[i] == 0)
+      child(i, n);
+  }
+  write(ring[0][1], "t", 1);
+  for(i = 0; i < n; i++)
+    read(done[0], &c, 1);
+  show("allocated", verbose);
+
+  // every other child first, then the rest.
+  for(i = 0; i < n; i += 2)
+    write(ring[i][1], "x", 1);
+  for(i = 0; i < n; i += 2)
+    wait(0);
+  show("half freed", verbose);
+  for(i = 1; i < n; i += 2)
+    write(ring[i][1], "x", 1);
+  for(i = 1; i < n; i += 2)
+    wait(0);
+
+  close(done[0]);
+  close(done[1]);
+  for(i = 0; i < n; i++){
+    close(ring[i][0]);
+    close(ring[i][1]);
+  }
+  memstat(&after);
+  show("all freed", verbose);
+
+  if(verbose)
+    printf("in blocks of 2 MiB or more: %d pages at start, %d at end\n",
+           freepages(&before, MEGAORDER), freepages(&after, MEGAORDER));
+  return freepages(&after, MEGAORDER) < freepages(&before, MEGAORDER);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n;
+
+  n = argc > 1 ? atoi(argv[1]) : 4;
+  if(n < 1 || n > MAXCHILD){
+    fprintf(2, "usage: fragtest [nchild], nchild at most %d\n", MAXCHILD);
+    exit(1);
+  }
+
+  run(n, 0);
+  printf("free blocks of order 0..%d:\n", MAXORDER);
+  if(run(n, 1) != 0){
+    printf("fragtest: FAILED, free memory did not join back up\n");
+    exit(1);
+  }
+  printf("fragtest: OK\n");
+  exit(0);
+}
@@ -0,0 +1,34 @@
+// Show physical memory and swap use, in 4096-byte pages.
+//
+//   free
+//
+// used is what is neither free nor in the kernel's caches:
+// zeroed pages kept for page tables and new pages, and
+// program file pages. The caches give their pages back when
+// memory runs out.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat st;
+  int i, nfree;
+
+  if(memstat(&st) < 0){
+    fprintf(2, "free: memstat failed\n");
+    exit(1);
+  }
+  nfree = st.cached;
+  for(i = 0; i <= MAXORDER; i++)
+    nfree += st.nfree[i] << i;
+
+  printf("\ttotal\tused\tfree\tzeroed\tpgcache\n");
+  printf("mem:\t%d\t%d\t%d\t%d\t%d\n", st.total,
+         st.total - nfree - st.zeroed - st.pgcache, nfree, st.zeroed, st.pgcache);
+  printf("swap:\t%d\t%d\t%d\n", st.swaptotal, st.swapused, st.swaptotal - st.swapused);
+  exit(0);
+}
@@ -0,0 +1,71 @@
+// Page allocator scaling benchmark.
+//
+//   kallocbench [maxworkers]
+//
+// For 1, 2, ... maxworkers (default 4) worker processes, each
+// worker grows its heap by NPAGE pages, touches every page, and
+// shrinks it again, ROUNDS times, so that every round is NPAGE
+// kalloc()s and NPAGE kfree()s. Every worker does the same work,
+// so if the allocator scales, the elapsed ticks stay flat until
+// there are more workers than CPUs.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define NPAGE  64
+#define ROUNDS 200
+
+void
+worker(void)
+{
+  int i, j;
+  char *a;
+
+  for(i = 0; i < ROUNDS; i++){
+    a = sbrk(NPAGE*PGSIZE);
+    if(a == (char*)-1){
+      fprintf(2, "kallocbench: sbrk failed\n");
+      exit(1);
+    }
+    for(j = 0; j < NPAGE; j++)
+      a[j*PGSIZE] = j;
+    sbrk(-NPAGE*PGSIZE);
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, i, maxw, start, ticks, xstatus;
+
+  maxw = argc > 1 ? atoi(argv[1]) : 4;
+  if(maxw < 1){
+    fprintf(2, "usage: kallocbench [maxworkers]\n");
+    exit(1);
+  }
+
+  printf("workers\tpages\tticks\n");
+  for(n = 1; n <= maxw; n++){
+    start = uptime();
+    for(i = 0; i < n; i++){
+      int pid = fork();
+      if(pid < 0){
+        fprintf(2, "kallocbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0)
+        worker();
+    }
+    for(i = 0; i < n; i++){
+      wait(&xstatus);
+      if(xstatus != 0)
+        exit(1);
+    }
+    ticks = uptime() - start;
+    printf("%d\t%d\t%d\n", n, n*NPAGE*ROUNDS, ticks);
+  }
+  exit(0);
+}
@@ -0,0 +1,81 @@
+// Show how often pages come from the allocating CPU's own
+// memory zone (see kernel/kalloc.c; make NODES=n for n zones).
+//
+//   numabench [nchild [npage]]
+//
+// nchild processes (default 4) each grow their heaps a page at
+// a time by npage touched pages (default 512), so that the
+// pages are allocated on first touch, on whatever CPUs the
+// children run on, and then exit. Prints, for each node, its
+// free pages before and after, and the pages its CPUs were
+// handed from their own zone (hits) and from other zones
+// (misses) during the run, from memstat().
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+void
+child(int npage)
+{
+  int i;
+  char *a;
+
+  for(i = 0; i < npage; i++){
+    if((a = sbrk(PGSIZE)) == (char*)-1){
+      fprintf(2, "numabench: sbrk failed\n");
+      exit(1);
+    }
+    *a = i;
+  }
+  exit(0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat before, after;
+  int i, n, npage, t;
+  uint64 hits, misses, h, m;
+
+  n = argc > 1 ? atoi(argv[1]) : 4;
+  npage = argc > 2 ? atoi(argv[2]) : 512;
+  if(n < 1 || npage < 1){
+    fprintf(2, "usage: numabench [nchild [npage]]\n");
+    exit(1);
+  }
+
+  memstat(&before);
+  t = uptime();
+  for(i = 0; i < n; i++){
+    int pid = fork();
+    if(pid < 0){
+      fprintf(2, "numabench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0)
+      child(npage);
+  }
+  for(i = 0; i < n; i++)
+    wait(0);
+  t = uptime() - t;
+  memstat(&after);
+
+  printf("numabench: %d children, %d pages each, %d ticks, %d nodes\n",
+         n, npage, t, after.nnode);
+  printf("node\tfree\tafter\thits\tmisses\tlocal\n");
+  hits = misses = 0;
+  for(i = 0; i < after.nnode; i++){
+    h = after.hits[i] - before.hits[i];
+    m = after.misses[i] - before.misses[i];
+    hits += h;
+    misses += m;
+    printf("%d\t%d\t%d\t%l\t%l\t%l%%\n", i, before.nodefree[i], after.nodefree[i],
+           h, m, h + m ? 100 * h / (h + m) : 100);
+  }
+  printf("all\t\t\t%l\t%l\t%l%%\n", hits, misses,
+         hits + misses ? 100 * hits / (hits + misses) : 100);
+  exit(0);
+}
@@ -0,0 +1,101 @@
+// Load generator for measuring scheduling latency while other
+// processes sit in long in-kernel loops: big write()s (writei),
+// forks of a large image (uvmcopy), and execs of a large
+// binary. The parent wakes up once per tick.
+//
+// Run it as
+//   schedtrace -l preemptlat
+// on a kernel built with SCHEDTRACE=1 and CPUS=1, with and
+// without KCOOP=1, and compare the max latency of the pid
+// that preemptlat prints.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define NWAKE 100
+
+char buf[8*BSIZE];
+
+void
+writer(void)
+{
+  int fd, i;
+
+  for(;;){
+    fd = open("preemptlat.tmp", O_CREATE|O_RDWR|O_TRUNC);
+    if(fd < 0){
+      fprintf(2, "preemptlat: open failed\n");
+      exit(1);
+    }
+    // stay under MAXFILE blocks.
+    for(i = 0; i < 30; i++)
+      write(fd, buf, sizeof(buf));
+    close(fd);
+  }
+}
+
+void
+forker(void)
+{
+  int pid;
+
+  if(sbrk(4*1024*1024) == (char*)-1){
+    fprintf(2, "preemptlat: sbrk failed\n");
+    exit(1);
+  }
+  for(;;){
+    pid = fork();
+    if(pid == 0)
+      exit(0);
+    if(pid > 0)
+      wait(0);
+  }
+}
+
+void
+execer(void)
+{
+  char *argv[] = { "usertests", "-x", 0 };
+  int pid;
+
+  for(;;){
+    pid = fork();
+    if(pid == 0){
+      close(1);
+      exec(argv[0], argv);
+      exit(1);
+    }
+    if(pid > 0)
+      wait(0);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, pids[3];
+
+  printf("preemptlat: probe pid %d\n", getpid());
+
+  if((pids[0] = fork()) == 0)
+    writer();
+  if((pids[1] = fork()) == 0)
+    forker();
+  if((pids[2] = fork()) == 0)
+    execer();
+
+  for(i = 0; i < NWAKE; i++)
+    sleep(1);
+
+  for(i = 0; i < 3; i++){
+    if(pids[i] > 0){
+      kill(pids[i]);
+      wait(0);
+    }
+  }
+  unlink("preemptlat.tmp");
+  exit(0);
+}
@@ -38,6 +38,22 @@ printint(int fd, int xx, int base, int sgn)
     putc(fd, buf[i]);
 }
 
+// an unsigned 64-bit number, for %l.
+static void
+printlong(int fd, uint64 x, int base)
+{
+  char buf[24];
+  int i;
+
+  i = 0;
+  do{
+    buf[i++] = digits[x % base];
+  }while((x /= base) != 0);
+
+  while(--i >= 0)
+    putc(fd, buf[i]);
+}
+
 static void
 printptr(int fd, uint64 x) {
   int i;
@@ -47,7 +63,7 @@ printptr(int fd, uint64 x) {
     putc(fd, digits[x >> (sizeof(uint64) * 8 - 4)]);
 }
 
-// Print to the given fd. Only understands %d, %x, %p, %s.
+// Print to the given fd. Only understands %d, %l, %x, %p, %s, %c.
 void
 vprintf(int fd, const char *fmt, va_list ap)
 {
@@ -67,7 +83,7 @@ vprintf(int fd, const char *fmt, va_list ap)
       if(c == 'd'){
         printint(fd, va_arg(ap, int), 10, 1);
       } else if(c == 'l') {
-        printint(fd, va_arg(ap, uint64), 10, 0);
+        printlong(fd, va_arg(ap, uint64), 10);
       } else if(c == 'x') {
         printint(fd, va_arg(ap, int), 16, 0);
       } else if(c == 'p') {
@@ -0,0 +1,51 @@
+// List processes and their memory.
+//
+//   ps
+//
+// For each process: pid, state, size of its memory below the
+// mmap()s in KiB, then its user pages resident in memory and
+// out in swap, and its page-table pages. The page counts show
+// as - for a process whose page table may be changing, such
+// as one running on another CPU.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+#define MAXPS 64
+
+struct procmem procs[MAXPS];
+
+// indexed by PM_* state.
+static char *states[] = { "unused", "used", "sleep", "runble", "run", "zombie" };
+
+void
+count(int n)
+{
+  if(n < 0)
+    printf("\t-");
+  else
+    printf("\t%d", n);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct procmem *p;
+  int n;
+
+  if((n = procmem(procs, MAXPS)) < 0){
+    fprintf(2, "ps: procmem failed\n");
+    exit(1);
+  }
+  printf("pid\tstate\tKiB\trss\tswapped\tptpages\tname\n");
+  for(p = procs; p < &procs[n]; p++){
+    printf("%d\t%s\t%l", p->pid, states[p->state], p->sz / 1024);
+    count(p->rss);
+    count(p->swapped);
+    count(p->ptpages);
+    printf("\t%s\n", p->name);
+  }
+  exit(0);
+}
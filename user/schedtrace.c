@@ -0,0 +1,207 @@
+// Dump the kernel's scheduler event trace.
+//
+//   schedtrace [-c | -l] [command [args...]]
+//
+// With a command, throws away the events logged so far, runs the
+// command, and dumps what was logged while it ran. -c prints
+// Chrome trace-event JSON (load in chrome://tracing or Perfetto)
+// instead of a timeline. -l prints each process's scheduling
+// latency, from wakeup to switch-in. Needs a kernel built with
+// SCHEDTRACE=1.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/schedtrace.h"
+#include "user/user.h"
+
+#define MAXEV 4096
+#define TIMEBASE_MHZ 10 // qemu virt's time CSR runs at 10 MHz
+
+struct schedevent ev[MAXEV];
+
+static char *names[] = {
+  [SCHED_EV_SWITCH_IN]  "switch-in",
+  [SCHED_EV_SWITCH_OUT] "switch-out",
+  [SCHED_EV_WAKEUP]     "wakeup",
+  [SCHED_EV_MIGRATE]    "migrate",
+  [SCHED_EV_DEMOTE]     "demote",
+  [SCHED_EV_AGE]        "age",
+  [SCHED_EV_PREEMPT]    "preempt",
+  [SCHED_EV_LOST]       "lost",
+};
+
+// why a process left the CPU, indexed by enum procstate.
+static char *states[] = { "unused", "used", "sleep", "runble", "run", "zombie" };
+
+int
+drain(void)
+{
+  int n, k;
+
+  n = 0;
+  while(n < MAXEV - 1 && (k = schedtrace(ev + n, MAXEV - n)) > 0)
+    n += k;
+  return k < 0 ? -1 : n;
+}
+
+// the kernel drains one CPU at a time; merge them by timestamp.
+void
+sort(int n)
+{
+  int i, j;
+  struct schedevent e;
+
+  for(i = 1; i < n; i++){
+    e = ev[i];
+    for(j = i; j > 0 && ev[j-1].ts > e.ts; j--)
+      ev[j] = ev[j-1];
+    ev[j] = e;
+  }
+}
+
+char*
+evname(int type)
+{
+  if(type > 0 && type < sizeof(names)/sizeof(names[0]) && names[type])
+    return names[type];
+  return "???";
+}
+
+void
+timeline(int n)
+{
+  int i;
+  uint64 us;
+
+  printf("time(us)\tcpu\tpid\tevent\n");
+  for(i = 0; i < n; i++){
+    us = (ev[i].ts - ev[0].ts) / TIMEBASE_MHZ;
+    printf("%l\t%d\t%d\t%s", us, ev[i].cpu, ev[i].pid, evname(ev[i].type));
+    switch(ev[i].type){
+    case SCHED_EV_SWITCH_OUT:
+      if(ev[i].arg >= 0 && ev[i].arg < sizeof(states)/sizeof(states[0]))
+        printf(" (%s)", states[ev[i].arg]);
+      break;
+    case SCHED_EV_MIGRATE:
+      printf(" from cpu %d", ev[i].arg);
+      break;
+    case SCHED_EV_DEMOTE:
+    case SCHED_EV_AGE:
+      printf(" to queue %d", ev[i].arg);
+      break;
+    case SCHED_EV_LOST:
+      printf(" %d events", ev[i].arg);
+      break;
+    }
+    printf("\n");
+  }
+}
+
+// one track per CPU: a slice from each switch-in to the
+// matching switch-out, plus instant events for the rest.
+void
+chrome(int n)
+{
+  int i;
+  uint64 us;
+
+  printf("[\n");
+  for(i = 0; i < n; i++){
+    us = (ev[i].ts - ev[0].ts) / TIMEBASE_MHZ;
+    if(ev[i].type == SCHED_EV_SWITCH_IN)
+      printf("{\"name\":\"pid %d\",\"ph\":\"B\"", ev[i].pid);
+    else if(ev[i].type == SCHED_EV_SWITCH_OUT)
+      printf("{\"name\":\"pid %d\",\"ph\":\"E\"", ev[i].pid);
+    else
+      printf("{\"name\":\"%s pid %d\",\"ph\":\"i\",\"s\":\"t\"", evname(ev[i].type), ev[i].pid);
+    printf(",\"ts\":%l,\"pid\":0,\"tid\":%d,\"args\":{\"arg\":%d}}%s\n",
+           us, ev[i].cpu, ev[i].arg, i == n-1 ? "" : ",");
+  }
+  printf("]\n");
+}
+
+// wakeup -> switch-in latency, per pid.
+void
+latency(int n)
+{
+  int i, j, k, npid;
+  int pids[64], cnt[64];
+  uint64 d, worst[64], total[64];
+
+  npid = 0;
+  for(i = 0; i < n; i++){
+    if(ev[i].type != SCHED_EV_WAKEUP)
+      continue;
+    for(j = i+1; j < n; j++)
+      if(ev[j].pid == ev[i].pid && ev[j].type == SCHED_EV_SWITCH_IN)
+        break;
+    if(j == n)
+      continue;
+    d = (ev[j].ts - ev[i].ts) / TIMEBASE_MHZ;
+    for(k = 0; k < npid && pids[k] != ev[i].pid; k++)
+      ;
+    if(k == npid){
+      if(npid == sizeof(pids)/sizeof(pids[0]))
+        continue;
+      pids[k] = ev[i].pid;
+      cnt[k] = 0;
+      worst[k] = total[k] = 0;
+      npid++;
+    }
+    cnt[k]++;
+    total[k] += d;
+    if(d > worst[k])
+      worst[k] = d;
+  }
+
+  printf("pid\twakeups\tavg(us)\tmax(us)\n");
+  for(k = 0; k < npid; k++)
+    printf("%d\t%d\t%l\t%l\n", pids[k], cnt[k], total[k] / cnt[k], worst[k]);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int n, pid, cflag = 0, lflag = 0;
+
+  if(argc > 1 && strcmp(argv[1], "-c") == 0){
+    cflag = 1;
+    argc--;
+    argv++;
+  } else if(argc > 1 && strcmp(argv[1], "-l") == 0){
+    lflag = 1;
+    argc--;
+    argv++;
+  }
+
+  if(argc > 1){
+    if(drain() < 0)
+      goto off;
+    pid = fork();
+    if(pid < 0){
+      fprintf(2, "schedtrace: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      exec(argv[1], argv + 1);
+      fprintf(2, "schedtrace: exec %s failed\n", argv[1]);
+      exit(1);
+    }
+    wait(0);
+  }
+
+  if((n = drain()) < 0)
+    goto off;
+  sort(n);
+  if(cflag)
+    chrome(n);
+  else if(lflag)
+    latency(n);
+  else
+    timeline(n);
+  exit(0);
+
+ off:
+  fprintf(2, "schedtrace: kernel not built with SCHEDTRACE=1\n");
+  exit(1);
+}
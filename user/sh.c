@@ -1,6 +1,7 @@
 // Shell.
 
 #include "kernel/types.h"
+#include "kernel/param.h"
 #include "user/user.h"
 #include "kernel/fcntl.h"
 
@@ -52,6 +53,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+int gettoken(char**, char*, char**, char**);
 
 // Execute cmd.  Never returns.
 void
@@ -130,6 +132,90 @@ runcmd(struct cmd *cmd)
   exit(0);
 }
 
+// Is the command line s just a program with redirections,
+// which parsecmd() can't fail on? The shell runs those itself
+// with spawn(), rather than forking a copy of itself to exec.
+// Each redirection takes two file actions, and spawn() takes
+// at most NOFILE.
+int
+simplecmd(char *s)
+{
+  char *es;
+  int tok, ntok, nredir;
+
+  es = s + strlen(s);
+  ntok = nredir = 0;
+  while((tok = gettoken(&s, es, 0, 0)) != 0){
+    if(tok == '<' || tok == '>' || tok == '+'){
+      if(gettoken(&s, es, 0, 0) != 'a' || 2*++nredir > NOFILE)
+        return 0;
+    } else if(tok != 'a'){
+      return 0;
+    }
+    if(++ntok >= MAXARGS)
+      return 0;
+  }
+  return ntok > 0;
+}
+
+void
+freecmd(struct cmd *cmd)
+{
+  if(cmd == 0)
+    return;
+  switch(cmd->type){
+  case REDIR:
+    freecmd(((struct redircmd*)cmd)->cmd);
+    break;
+  case PIPE:
+  case LIST:
+    freecmd(((struct pipecmd*)cmd)->left);
+    freecmd(((struct pipecmd*)cmd)->right);
+    break;
+  case BACK:
+    freecmd(((struct backcmd*)cmd)->cmd);
+    break;
+  }
+  free(cmd);
+}
+
+// Run cmd, a simple command from simplecmd(), with spawn(),
+// and wait for it. The redirections' files are opened here,
+// outermost first as runcmd() does, and passed to the child
+// as file actions.
+void
+spawncmd(struct cmd *cmd)
+{
+  struct spawnact acts[NOFILE];
+  struct redircmd *rcmd;
+  struct execcmd *ecmd;
+  int i, n, fd;
+
+  n = 0;
+  for(; cmd->type == REDIR; cmd = rcmd->cmd){
+    rcmd = (struct redircmd*)cmd;
+    if((fd = open(rcmd->file, rcmd->mode)) < 0){
+      fprintf(2, "open %s failed\n", rcmd->file);
+      goto done;
+    }
+    acts[n].op = SPAWN_DUP;
+    acts[n].fd = rcmd->fd;
+    acts[n].src = fd;
+    acts[n+1].op = SPAWN_CLOSE;
+    acts[n+1].fd = fd;
+    n += 2;
+  }
+  ecmd = (struct execcmd*)cmd;
+  if(spawn(ecmd->argv[0], ecmd->argv, acts, n) < 0)
+    fprintf(2, "exec %s failed\n", ecmd->argv[0]);
+  else
+    wait(0);
+
+ done:
+  for(i = 0; i < n; i += 2)
+    close(acts[i].src);
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -145,6 +231,7 @@ int
 main(void)
 {
   static char buf[100];
+  struct cmd *cmd;
   int fd;
 
   // Ensure that three file descriptors are open.
@@ -164,6 +251,12 @@ main(void)
         fprintf(2, "cannot cd %s\n", buf+3);
       continue;
     }
+    if(simplecmd(buf)){
+      cmd = parsecmd(buf);
+      spawncmd(cmd);
+      freecmd(cmd);
+      continue;
+    }
     if(fork1() == 0)
       runcmd(parsecmd(buf));
     wait(0);
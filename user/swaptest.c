@@ -0,0 +1,120 @@
+// Overcommit memory, so that the kernel has to swap.
+//
+//   swaptest [extra]
+//
+// First forks a child that fills extra pages and then sleeps
+// in read() on a pipe. Then grows the heap a page at a time,
+// so that it isn't mapped with megapages, to all of free
+// memory, from memstat(), plus extra pages (default 1024,
+// 4 MiB). Each page gets its number written into it. Then
+// reads every page back twice, checking the numbers, which
+// brings the swapped-out pages back in, and prints the ticks
+// each step took. The sleeping child must have lost some of
+// its pages to swap, from procmem(); it then checks them all.
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/memstat.h"
+#include "user/user.h"
+
+// grow the heap by n pages, writing each page's number
+// plus tag into it. Returns the first page.
+char*
+fill(int n, int tag)
+{
+  char *base, *a;
+  int i;
+
+  base = sbrk(0);
+  for(i = 0; i < n; i++){
+    if((a = sbrk(PGSIZE)) == (char*)-1){
+      fprintf(2, "swaptest: sbrk failed\n");
+      exit(1);
+    }
+    *(int*)a = i + tag;
+  }
+  return base;
+}
+
+// check the n pages from base that fill() wrote.
+void
+check(char *base, int n, int tag)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(*(int*)(base + i*PGSIZE) != i + tag){
+      printf("swaptest: FAILED, page %d holds %d\n", i, *(int*)(base + i*PGSIZE));
+      exit(1);
+    }
+  }
+}
+
+// the child's swapped-out pages, from procmem().
+int
+swapped(int pid)
+{
+  static struct procmem procs[64];
+  int i, n;
+
+  n = procmem(procs, 64);
+  for(i = 0; i < n; i++)
+    if(procs[i].pid == pid)
+      return procs[i].swapped;
+  return -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct memstat st;
+  int i, pass, n, extra, t, pid, up[2], down[2], xst;
+  char *base, c;
+
+  extra = argc > 1 ? atoi(argv[1]) : 1024;
+  if(pipe(up) < 0 || pipe(down) < 0){
+    fprintf(2, "swaptest: pipe failed\n");
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    fprintf(2, "swaptest: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    base = fill(extra, 1000000);
+    write(up[1], "x", 1);
+    read(down[0], &c, 1);
+    check(base, extra, 1000000);
+    exit(0);
+  }
+  read(up[0], &c, 1);
+
+  memstat(&st);
+  n = st.cached + extra;
+  for(i = 0; i <= MAXORDER; i++)
+    n += st.nfree[i] << i;
+
+  printf("swaptest: %d pages, %d more than are free\n", n, extra);
+  t = uptime();
+  base = fill(n, 0);
+  printf("written in %d ticks\n", uptime() - t);
+
+  for(pass = 0; pass < 2; pass++){
+    t = uptime();
+    check(base, n, 0);
+    printf("read back in %d ticks\n", uptime() - t);
+  }
+
+  n = swapped(pid);
+  printf("sleeping child has %d of its %d pages swapped out\n", n, extra);
+  write(down[1], "x", 1);
+  wait(&xst);
+  if(n <= 0 || xst != 0){
+    printf("swaptest: FAILED, %s\n", n <= 0 ? "child kept its pages" : "child's pages wrong");
+    exit(1);
+  }
+  printf("swaptest: OK\n");
+  exit(0);
+}
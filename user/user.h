@@ -1,5 +1,9 @@
 struct stat;
 struct rtcdate;
+struct schedevent;
+struct memstat;
+struct procmem;
+struct spawnact;
 
 // system calls
 int fork(void);
@@ -26,6 +30,12 @@ int sleep(int);
 int uptime(void);
 int trace(int);
 int setpriority(int,int);
+int schedtrace(struct schedevent*, int);
+void* mmap(void*, int, int, int, int, int);
+int munmap(void*, int);
+int memstat(struct memstat*);
+int procmem(struct procmem*, int);
+int spawn(char*, char**, struct spawnact*, int);
 
 // ulib.c
 int stat(const char*, struct stat*);
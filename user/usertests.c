@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/memstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -809,6 +810,330 @@ killstatus(char *s)
   exit(0);
 }
 
+// kill() and setpriority() of a reaped pid must fail,
+// even though its proc slot is handed to a new child.
+void
+killreaped(char *s)
+{
+  int pid1, pid2, xst;
+
+  for(int i = 0; i < 100; i++){
+    pid1 = fork();
+    if(pid1 < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid1 == 0)
+      exit(0);
+    wait(0);
+
+    pid2 = fork();
+    if(pid2 < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid2 == 0){
+      sleep(5);
+      exit(0);
+    }
+    if(pid2 == pid1){
+      printf("%s: pid %d reused\n", s, pid1);
+      exit(1);
+    }
+    if(kill(pid1) != -1 || setpriority(60, pid1) != -1){
+      printf("%s: kill/setpriority found reaped pid %d\n", s, pid1);
+      exit(1);
+    }
+    wait(&xst);
+    if(xst != 0){
+      printf("%s: live child was killed\n", s);
+      exit(1);
+    }
+  }
+  exit(0);
+}
+
+// fork() of a process using most of memory only works if
+// the child shares its pages copy-on-write, and stores by
+// either side must not show up in the other.
+void
+cowfork(char *s)
+{
+  uint64 sz = (PHYSTOP - KERNBASE) / 3 * 2;
+  int pid, ppid, xst;
+  char *a, *p;
+
+  ppid = getpid();
+  a = sbrk(sz);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + sz; p += PGSIZE)
+    *(int*)p = ppid;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + 16*PGSIZE; p += PGSIZE)
+      *(int*)p = 0;
+    for(p = a + 16*PGSIZE; p < a + sz; p += PGSIZE){
+      if(*(int*)p != ppid){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+    }
+    exit(0);
+  }
+  for(p = a + sz - 16*PGSIZE; p < a + sz; p += PGSIZE)
+    *(int*)p = -1;
+  wait(&xst);
+  if(xst != 0)
+    exit(1);
+  for(p = a; p < a + sz - 16*PGSIZE; p += PGSIZE){
+    if(*(int*)p != ppid){
+      printf("%s: parent sees child's store\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-sz);
+}
+
+// a big heap is mapped with megapages; fork() and a
+// shrinking sbrk() split them, and must keep the data.
+void
+megapage(char *s)
+{
+  uint64 sz = 3*MEGAPGSIZE, cut = MEGAPGSIZE + MEGAPGSIZE/2;
+  int pid, xst, want;
+  char *a, *p;
+
+  a = sbrk(sz);
+  if(a == (char*)-1){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + sz; p += PGSIZE)
+    *(int*)p = (p - a) / PGSIZE;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    for(p = a; p < a + sz; p += PGSIZE){
+      if(*(int*)p != (p - a) / PGSIZE){
+        printf("%s: child sees wrong data\n", s);
+        exit(1);
+      }
+      *(int*)p = -1;
+    }
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != 0)
+    exit(1);
+
+  // cut through the middle of a megapage, then grow back.
+  sbrk(-cut);
+  sbrk(cut);
+  for(p = a; p < a + sz; p += PGSIZE){
+    want = p < a + sz - cut ? (p - a) / PGSIZE : 0;
+    if(*(int*)p != want){
+      printf("%s: wrong data at %p\n", s, p);
+      exit(1);
+    }
+  }
+  sbrk(-sz);
+}
+
+// mmap() a file privately and shared, and anonymous shared
+// memory across fork(); stores to a MAP_SHARED file mapping
+// must reach the file after munmap(), and others must not.
+void
+mmaptest(char *s)
+{
+  int fd, i, n, pid, xst;
+  int len = 2*PGSIZE + PGSIZE/2;
+  char *a;
+
+  fd = open("mmap.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(buf); i++)
+    buf[i] = i % 251;
+  for(n = 0; n < len; n += i){
+    i = len - n < sizeof(buf) ? len - n : sizeof(buf);
+    if(write(fd, buf, i) != i){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+
+  a = mmap(0, len, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < len; i++){
+    if(a[i] != (char)(i % 251)){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  // the tail of the last page is zero.
+  if(a[len] != 0 || a[3*PGSIZE-1] != 0){
+    printf("%s: tail not zero\n", s);
+    exit(1);
+  }
+  a[0] = 'P';
+  if(munmap(a, len) < 0){
+    printf("%s: munmap private failed\n", s);
+    exit(1);
+  }
+
+  a = mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  a[0] = 'S';
+  a[PGSIZE] = 'S';
+  a[len-1] = 'S';
+  // munmap the first page, then the rest.
+  if(munmap(a, PGSIZE) < 0 || munmap(a + PGSIZE, len - PGSIZE) < 0){
+    printf("%s: munmap shared failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmap.tmp", O_RDONLY);
+  if(read(fd, buf, 1) != 1 || buf[0] != 'S'){
+    printf("%s: shared store not written back\n", s);
+    exit(1);
+  }
+  if(read(fd, buf, PGSIZE) != PGSIZE || buf[PGSIZE-1] != 'S'){
+    printf("%s: shared store not written back\n", s);
+    exit(1);
+  }
+  // the file is not writable through fd.
+  if(mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != MAP_FAILED){
+    printf("%s: mmap of read-only fd succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmap.tmp");
+
+  a = mmap(0, 4*PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap anonymous failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a[3*PGSIZE] = 'C';
+    exit(0);
+  }
+  wait(&xst);
+  if(xst != 0 || a[3*PGSIZE] != 'C'){
+    printf("%s: child's store not shared\n", s);
+    exit(1);
+  }
+  munmap(a, 4*PGSIZE);
+}
+
+// write() to a file that is mmap()ed MAP_SHARED shows up in
+// the mapping, and munmap() doesn't write the old bytes back
+// over it.
+void
+mmapwrite(char *s)
+{
+  int fd, fd2, i;
+  char *a;
+
+  fd = open("mmapw.tmp", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'a', PGSIZE);
+  if(write(fd, buf, PGSIZE) != PGSIZE){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  a = mmap(0, PGSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(a == MAP_FAILED){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  a[200] = 'm';
+  // bytes 100-103 through a second fd, from offset 0.
+  fd2 = open("mmapw.tmp", O_WRONLY);
+  memset(buf, 'a', 100);
+  memmove(buf + 100, "wwww", 4);
+  if(fd2 < 0 || write(fd2, buf, 104) != 104){
+    printf("%s: write through second fd failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+  if(a[100] != 'w' || a[103] != 'w' || a[200] != 'm'){
+    printf("%s: mapping missed the write\n", s);
+    exit(1);
+  }
+  munmap(a, PGSIZE);
+  close(fd);
+
+  fd = open("mmapw.tmp", O_RDONLY);
+  if(read(fd, buf, PGSIZE) != PGSIZE){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapw.tmp");
+  for(i = 0; i < PGSIZE; i++){
+    if(buf[i] != (i == 200 ? 'm' : i >= 100 && i < 104 ? 'w' : 'a')){
+      printf("%s: byte %d is %c\n", s, i, buf[i]);
+      exit(1);
+    }
+  }
+}
+
+// mmap() refuses protections a RISC-V PTE can't express:
+// none at all, and writable or executable but not readable.
+void
+mmapprot(char *s)
+{
+  static int bad[] = { 0, PROT_WRITE, PROT_EXEC, PROT_WRITE|PROT_EXEC };
+  int fd, i;
+
+  fd = open("README", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open README failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < sizeof(bad)/sizeof(bad[0]); i++){
+    if(mmap(0, PGSIZE, bad[i], MAP_PRIVATE, fd, 0) != MAP_FAILED){
+      printf("%s: mmap of file with prot %d succeeded\n", s, bad[i]);
+      exit(1);
+    }
+    if(mmap(0, PGSIZE, bad[i], MAP_PRIVATE|MAP_ANONYMOUS, -1, 0) != MAP_FAILED){
+      printf("%s: anonymous mmap with prot %d succeeded\n", s, bad[i]);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(char *s)
@@ -2003,6 +2328,184 @@ dirfile(char *s)
   close(fd);
 }
 
+// spawn() runs echo with its output dup()ed onto a pipe, and
+// fails cleanly on a bad file action or a missing program.
+void
+spawntest(char *s)
+{
+  char *echoargv[] = { "echo", "OK", 0 };
+  struct spawnact acts[2];
+  int fds[2], xstatus, pid;
+  char buf[3];
+
+  if(pipe(fds) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  acts[0].op = SPAWN_DUP;
+  acts[0].fd = 1;
+  acts[0].src = fds[1];
+  acts[1].op = SPAWN_CLOSE;
+  acts[1].fd = fds[0];
+  if((pid = spawn("echo", echoargv, acts, 2)) < 0){
+    printf("%s: spawn echo failed\n", s);
+    exit(1);
+  }
+  close(fds[1]);
+  if(read(fds[0], buf, 3) != 3 || buf[0] != 'O' || buf[1] != 'K' || buf[2] != '\n'){
+    printf("%s: wrong output\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  if(wait(&xstatus) != pid || xstatus != 0){
+    printf("%s: wait failed\n", s);
+    exit(1);
+  }
+
+  acts[0].src = NOFILE;
+  if(spawn("echo", echoargv, acts, 1) >= 0){
+    printf("%s: spawn with a bad fd succeeded\n", s);
+    exit(1);
+  }
+  if(spawn("nosuchprogram", echoargv, 0, 0) >= 0){
+    printf("%s: spawn of a missing program succeeded\n", s);
+    exit(1);
+  }
+  if(wait(0) != -1){
+    printf("%s: failed spawn left a child\n", s);
+    exit(1);
+  }
+}
+
+// procmem() counts the pages a sleeping child has touched,
+// and reports the caller itself as running.
+void
+procmemtest(char *s)
+{
+  static struct procmem procs[64];
+  struct procmem *p, *me, *kid;
+  int up[2], down[2], pid, n, i;
+  char *a, c;
+
+  if(pipe(up) < 0 || pipe(down) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    a = sbrk(32*PGSIZE);
+    for(i = 0; i < 32; i++)
+      a[i*PGSIZE] = i;
+    write(up[1], "x", 1);
+    read(down[0], &c, 1);
+    exit(0);
+  }
+  read(up[0], &c, 1);
+
+  // give the child a few ticks to get to sleep in read().
+  for(i = 0; i < 10; i++){
+    sleep(1);
+    n = procmem(procs, 64);
+    me = kid = 0;
+    for(p = procs; p < &procs[n]; p++){
+      if(p->pid == getpid())
+        me = p;
+      if(p->pid == pid)
+        kid = p;
+    }
+    if(kid && kid->state == PM_SLEEPING)
+      break;
+  }
+  write(down[1], "x", 1);
+  wait(0);
+  if(me == 0 || kid == 0){
+    printf("%s: procmem() missed a process\n", s);
+    exit(1);
+  }
+  if(me->state != PM_RUNNING || me->rss <= 0){
+    printf("%s: procmem() state %d rss %d for the caller\n", s, me->state, me->rss);
+    exit(1);
+  }
+  // the child is asleep in read(), so its page table is
+  // counted: root, and a level-1 and a level-0 page each for
+  // the program and the trampoline.
+  if(kid->state != PM_SLEEPING || kid->rss < 32 || kid->ptpages < 5){
+    printf("%s: procmem() state %d rss %d ptpages %d for the child\n", s,
+           kid->state, kid->rss, kid->ptpages);
+    exit(1);
+  }
+}
+
+// open files and pipes come from slab caches, so the
+// system as a whole can have more than the old table's 100
+// files open, all at once.
+void
+manyfiles(char *s)
+{
+  enum { NCHILD = 12, NPIPE = 5 };
+  int i, j, n, fds[NPIPE][2], ready[2], go[2], xstatus;
+  char c;
+
+  if(pipe(ready) < 0 || pipe(go) < 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      close(ready[0]);
+      close(go[1]);
+      for(j = 0; j < NPIPE; j++){
+        if(pipe(fds[j]) < 0){
+          printf("%s: pipe %d failed\n", s, j);
+          exit(1);
+        }
+        if(write(fds[j][1], "x", 1) != 1)
+          exit(1);
+      }
+      // hold them until every child has made its own. close
+      // ready[1] so that the parent sees end-of-file rather than
+      // waiting for good if a sibling fails before writing.
+      write(ready[1], "r", 1);
+      close(ready[1]);
+      read(go[0], &c, 1);
+      for(j = 0; j < NPIPE; j++)
+        if(read(fds[j][0], &c, 1) != 1 || c != 'x')
+          exit(1);
+      exit(0);
+    }
+  }
+  close(ready[1]);
+  close(go[0]);
+  for(n = 0; n < NCHILD; n++)
+    if(read(ready[0], &c, 1) != 1)
+      break;
+  close(ready[0]);
+  close(go[1]);
+  for(i = 0; i < NCHILD; i++){
+    if(wait(&xstatus) < 0){
+      printf("%s: wait failed\n", s);
+      exit(1);
+    }
+    if(xstatus != 0){
+      printf("%s: child failed\n", s);
+      exit(1);
+    }
+  }
+  if(n != NCHILD){
+    printf("%s: only %d children got ready\n", s, n);
+    exit(1);
+  }
+}
+
 // test that iput() is called at the end of _namei().
 // also tests empty file names.
 void
@@ -2046,7 +2549,7 @@ iref(char *s)
 void
 forktest(char *s)
 {
-  enum{ N = 1000 };
+  enum{ N = MAXPROC+1 };
   int n, pid;
 
   for(n=0; n<N; n++){
@@ -2063,7 +2566,7 @@ forktest(char *s)
   }
 
   if(n == N){
-    printf("%s: fork claimed to work 1000 times!\n", s);
+    printf("%s: fork claimed to work %d times!\n", s, N);
     exit(1);
   }
 
@@ -2482,8 +2985,9 @@ void argptest(char *s)
   close(fd);
 }
 
-// check that there's an invalid page beneath
-// the user stack, to catch stack overflow.
+// check that the user stack can grow to NSTACK pages, and
+// that there's an invalid page beneath that, to catch stack
+// overflow.
 void
 stacktest(char *s)
 {
@@ -2492,7 +2996,8 @@ stacktest(char *s)
   
   pid = fork();
   if(pid == 0) {
-    char *sp = (char *) r_sp();
+    volatile char *sp = (char *) USTACKBASE;
+    *sp = 1;
     sp -= PGSIZE;
     // the *sp should cause a trap.
     printf("%s: stacktest: read below stack %p\n", s, *sp);
@@ -2508,6 +3013,44 @@ stacktest(char *s)
     exit(xstatus);
 }
 
+// each call puts two pages on the stack, and returns the sum
+// of the bytes it and the calls below it stored in them.
+int
+stackdeep(int depth)
+{
+  volatile char buf[2*PGSIZE];
+  int sum;
+
+  buf[0] = buf[PGSIZE] = depth;
+  sum = depth > 0 ? stackdeep(depth - 1) : 0;
+  return sum + buf[0] + buf[PGSIZE];
+}
+
+// a deep recursion grows the user stack well past a page,
+// in a process and in its forked child.
+void
+stackgrow(char *s)
+{
+  int pid, xstatus;
+
+  if(stackdeep(100) != 100*101){
+    printf("%s: wrong sum from the stack\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(stackdeep(100) != 100*101);
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: wrong sum in the child\n", s);
+    exit(1);
+  }
+}
+
 // regression test. copyin(), copyout(), and copyinstr() used to cast
 // the virtual page address to uint, which (with certain wild system
 // call arguments) resulted in a kernel page faults.
@@ -2862,6 +3405,7 @@ main(int argc, char *argv[])
     {sbrk8000, "sbrk8000"},
     {validatetest, "validatetest"},
     {stacktest, "stacktest"},
+    {stackgrow, "stackgrow"},
     {opentest, "opentest"},
     {writetest, "writetest"},
     {writebig, "writebig"},
@@ -2872,6 +3416,12 @@ main(int argc, char *argv[])
     {mem, "mem"},
     {pipe1, "pipe1"},
     {killstatus, "killstatus"},
+    {killreaped, "killreaped"},
+    {cowfork, "cowfork"},
+    {megapage, "megapage"},
+    {mmaptest, "mmaptest"},
+    {mmapprot, "mmapprot"},
+    {mmapwrite, "mmapwrite"},
     {preempt, "preempt"},
     {exitwait, "exitwait"},
     {rmdot, "rmdot"},
@@ -2879,6 +3429,9 @@ main(int argc, char *argv[])
     {bigfile, "bigfile"},
     {dirfile, "dirfile"},
     {iref, "iref"},
+    {manyfiles, "manyfiles"},
+    {procmemtest, "procmemtest"},
+    {spawntest, "spawntest"},
     {forktest, "forktest"},
     {bigdir, "bigdir"}, // slow
     { 0, 0},
@@ -38,4 +38,10 @@ entry("sleep");
 entry("uptime");
 entry("waitx");
 entry("trace");
-entry("setpriority")
+entry("setpriority");
+entry("schedtrace");
+entry("mmap");
+entry("munmap");
+entry("memstat");
+entry("procmem");
+entry("spawn");